@@ -122,7 +122,7 @@ static const struct app_callbacks user_app_callbacks = {
     .app_on_get_dev_appearance          = default_app_on_get_dev_appearance,
     .app_on_get_dev_slv_pref_params     = default_app_on_get_dev_slv_pref_params,
     .app_on_set_dev_info                = default_app_on_set_dev_info,
-    .app_on_data_length_change          = NULL,
+    .app_on_data_length_change          = user_on_data_length_change,
     .app_on_update_params_request       = default_app_update_params_request,
     .app_on_generate_static_random_addr = default_app_generate_static_random_addr,
     .app_on_svc_changed_cfg_ind         = NULL,
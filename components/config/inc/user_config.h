@@ -185,6 +185,14 @@ static const struct advertise_configuration user_adv_conf = {
 /// Device name length
 #define USER_DEVICE_NAME_LEN    (sizeof(USER_DEVICE_NAME)-1)
 
+/// Largest ATT MTU we'll agree to.  247 puts a full 251 octet data channel PDU (4 of L2CAP header) to use.
+#define USER_CFG_MAX_MTU        247
+
+/// Data length extension: the largest link layer payload, and the time it takes on air at 1M,
+/// (octets + 11 + 3) * 8 us
+#define USER_CFG_MAX_TX_OCTETS  CFG_MAX_TX_PACKET_LENGTH
+#define USER_CFG_MAX_TX_TIME    ((USER_CFG_MAX_TX_OCTETS + 11 + 3) * 8)
+
 /*
  ****************************************************************************************
  *
@@ -198,7 +206,7 @@ static const struct gapm_configuration user_gapm_conf = {
 
     /// Maximal MTU. Shall be set to 23 if Legacy Pairing is used, 65 if Secure Connection is used,
     /// more if required by the application
-    .max_mtu = 23,
+    .max_mtu = USER_CFG_MAX_MTU,
 
     /// Device Address Type
     .addr_type = APP_CFG_ADDR_TYPE(USER_CFG_ADDRESS_MODE),
@@ -252,13 +260,13 @@ static const struct gapm_configuration user_gapm_conf = {
      */
 
     /// Maximal MPS
-    .max_mps = 0,
+    .max_mps = USER_CFG_MAX_MTU,
 
     /// Maximal Tx octets (connInitialMaxTxOctets value, as defined in 4.2 Specification)
-    .max_txoctets = 0,
+    .max_txoctets = USER_CFG_MAX_TX_OCTETS,
 
     /// Maximal Tx time (connInitialMaxTxTime value, as defined in 4.2 Specification)
-    .max_txtime = 0,
+    .max_txtime = USER_CFG_MAX_TX_TIME,
 };
 
 /*
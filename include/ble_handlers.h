@@ -15,6 +15,7 @@
 
 void user_catch_rest_hndl(ke_msg_id_t const msgid, void const *param, ke_task_id_t const dest_id, ke_task_id_t const src_id);
 void user_on_connection(uint8_t connection_idx, struct gapc_connection_req_ind const *param);
+void user_on_data_length_change(uint8_t connection_idx, struct gapc_le_pkt_size_ind *param);
 void user_on_disconnect(struct gapc_disconnect_ind const *param);
 
 #endif // BLE_HANDLERS_H_
@@ -0,0 +1,64 @@
+#ifndef BLE_OPS_H_
+#define BLE_OPS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <custs1_task.h>
+#include "updi_device.h"
+
+/**
+ * Operations requested over the Operation characteristic.  Each write there is:
+ *   id (1), opcode (1), address (4), length (2), all little endian.
+ * The id is the client's own, and comes back in the result notification for that operation.  Operations are
+ * copied (with any data they need from the Data characteristic) and queued, so the client can carry on writing
+ * the next one without waiting for the result.
+ */
+#define BLE_OP_READ             0x01    // Read length bytes (up to the Data characteristic's size) from address.  The Data characteristic then reads back as them.
+#define BLE_OP_WRITE_FLASH      0x02    // Write length bytes of Data to the flash page at address
+#define BLE_OP_WRITE_EEPROM     0x03    // Write length bytes of Data to the EEPROM page at address
+#define BLE_OP_VERIFY_PAGE      0x04    // Compare the flash page at address with length bytes of Data
+#define BLE_OP_VERIFY_FLASH     0x05    // Have the target CRC its flash
+#define BLE_OP_RESET            0x06    // Reset the target, leaving programming mode
+#define BLE_OP_CONNECT          0x07    // Re-establish the UPDI link.  The Data characteristic then reads back as the SIB.
+#define BLE_OP_DEVICE_INFO      0x08    // The Data characteristic reads back as a ble_op_device_info_t
+#define BLE_OP_UPLOAD_START     0x09    // Open a streaming upload to the flash page at address (see ble_upload.h)
+#define BLE_OP_UPLOAD_END       0x0A    // Finish the upload.  The result comes once the last page is written.
+#define BLE_OP_UPLOAD_START_HS  0x0B    // As BLE_OP_UPLOAD_START, for a heatshrink compressed image
+
+// Or'd into the opcode of a page write or an upload start: each page is read first, and left alone if it already
+// holds what would be written.  Worth it when re-flashing an image that has mostly not changed; for a fresh image
+// it only adds the read.
+#define BLE_OP_FLAG_DIFF        0x80
+
+// Result statuses.  Anything from UPDI_OK up is the updi_err_t the operation finished with.
+#define BLE_OP_STATUS_NO_DEVICE 0xFD    // The target hasn't been identified
+#define BLE_OP_STATUS_BUSY      0xFE    // Too many operations queued up already; try again after the next result
+#define BLE_OP_STATUS_INVALID   0xFF    // Unknown opcode, or a length that doesn't fit
+
+// Most that can be written in one operation.  Reads are held to what one read of the Data characteristic returns.
+#define BLE_OPS_DATA_MAX UPDI_MAX_PAGE_SZ
+// What comes before the page in a Bulk characteristic write
+#define BLE_OPS_BULK_HDR_SZ 6
+
+typedef struct __attribute__((packed)) {
+    uint8_t signature[UPDI_SIGNATURE_SZ];
+    uint8_t nvm_version;
+    uint32_t flash_base;
+    uint32_t flash_size;
+    uint16_t flash_page_size;
+    uint16_t eeprom_base;
+    uint16_t eeprom_size;
+    uint16_t eeprom_page_size;
+    uint16_t user_row_addr;
+    uint16_t user_row_size;
+} ble_op_device_info_t;
+
+void ble_ops_notify(uint8_t id, uint8_t status);
+void ble_ops_connected(uint8_t conidx);
+void ble_ops_disconnected();
+void ble_ops_write_operation(struct custs1_val_write_ind const *param);
+void ble_ops_write_data(struct custs1_val_write_ind const *param);
+void ble_ops_write_bulk(struct custs1_val_write_ind const *param);
+void ble_ops_read_data(struct custs1_value_req_ind const *param);
+
+#endif // BLE_OPS_H_
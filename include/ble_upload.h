@@ -0,0 +1,35 @@
+#ifndef BLE_UPLOAD_H_
+#define BLE_UPLOAD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <custs1_task.h>
+
+/**
+ * Streaming flash upload.  BLE_OP_UPLOAD_START (with a page aligned address) opens it and is answered straight
+ * away, along with a notification on the Upload characteristic granting the first credits.  The client then
+ * writes the image, in order, to the Upload characteristic with Write Command: one credit per write.  Each
+ * notification on Upload is one byte, the number of credits handed back.  BLE_OP_UPLOAD_END writes out what's
+ * left and its result comes once every page is in.  If a page fails, the result for the START id carries the
+ * error (as does the END result, if END has already been sent) and the rest of the upload is dropped.
+ *
+ * BLE_OP_UPLOAD_START_HS is the same, but the bytes written are heatshrink compressed (see hs_decoder.h), and are
+ * unpacked straight into the page buffers as they are used.  Credits still count writes, not unpacked bytes.
+ *
+ * Either start can carry BLE_OP_FLAG_DIFF, to skip pages the target already holds.
+ */
+
+// Writes we will hold on to before the client has to wait for credits
+#define BLE_UPLOAD_QUEUE_SZ 6
+// Page buffers: one filling from BLE while the others are written over UPDI
+#define BLE_UPLOAD_PAGES 2
+// Credits are handed back once this many have built up (or the queue has drained), to save notifications.
+#define BLE_UPLOAD_CREDIT_BATCH 2
+
+uint8_t ble_upload_start(uint8_t id, uint32_t address, bool compressed, bool diff);
+uint8_t ble_upload_end(uint8_t id);
+void ble_upload_write(struct custs1_val_write_ind const *param);
+void ble_upload_connected(uint8_t conidx);
+void ble_upload_disconnected();
+
+#endif // BLE_UPLOAD_H_
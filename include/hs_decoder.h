@@ -0,0 +1,33 @@
+#ifndef HS_DECODER_H_
+#define HS_DECODER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Streaming decoder for heatshrink's LZSS format, so compressed images can be unpacked on the way into the page
+ * buffers.  The stream has to be made with the same window and lookahead sizes (heatshrink -w 8 -l 4).
+ */
+#define HS_WINDOW_BITS 8
+#define HS_LOOKAHEAD_BITS 4
+#define HS_WINDOW_SZ (1 << HS_WINDOW_BITS)
+
+typedef struct {
+    // The last HS_WINDOW_SZ bytes output, for back references to copy from
+    uint8_t window[HS_WINDOW_SZ];
+    uint16_t head;
+    // Input bits not yet used, most significant first
+    uint16_t bits;
+    uint8_t bit_count;
+    uint8_t state;
+    // The back reference being copied out
+    uint16_t index;
+    uint16_t count;
+} hs_decoder_t;
+
+void hs_decoder_reset(hs_decoder_t *hs);
+uint16_t hs_decoder_run(hs_decoder_t *hs, const uint8_t *in, uint16_t in_len, uint16_t *in_used,
+                        uint8_t *out, uint16_t out_len);
+bool hs_decoder_pending(const hs_decoder_t *hs);
+
+#endif // HS_DECODER_H_
@@ -0,0 +1,34 @@
+#ifndef TIMEBASE_H_
+#define TIMEBASE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Resolution of deadlines.  Timer0 only interrupts (and so only runs) while at least one deadline is armed.
+#define TIMEBASE_TICK_US 100
+// Delays shorter than this are spun out against the calibrated loop rather than slept through.
+#define TIMEBASE_SPIN_MAX_US 1000
+
+/**
+ * A point in time to wait for.  Any number can be armed at once (they are just a tick count to compare against),
+ * but each one armed must be ended again, as that's what lets the timer stop.
+ */
+typedef struct {
+    uint32_t at;
+    bool armed;
+} timebase_deadline_t;
+
+/**
+ * What timebase_wait() is waiting on besides the deadline.  Called with interrupts masked, so it must be quick,
+ * and should only look at state that an interrupt handler updates.
+ */
+typedef bool (*timebase_cond_t)(void);
+
+void timebase_init();
+void timebase_deadline_start(timebase_deadline_t *deadline, uint32_t us);
+void timebase_deadline_end(timebase_deadline_t *deadline);
+bool timebase_expired(const timebase_deadline_t *deadline);
+bool timebase_wait(const timebase_deadline_t *deadline, timebase_cond_t ready);
+void timebase_delay_us(uint32_t us);
+
+#endif // TIMEBASE_H_
@@ -2,8 +2,27 @@
 #define UPDI_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "user_periph_setup.h"
 
+
+// Minimum time the line has to be held low for the target to see a break, at its slowest UPDI clock
+#define UPDI_BREAK_MS 25
+
+// ASI_SYS_STATUS bits, as returned by updi_read_sys_status()
+#define UPDI_ASI_SYS_STATUS_RSTSYS 5
+#define UPDI_ASI_SYS_STATUS_INSLEEP 4
+#define UPDI_ASI_SYS_STATUS_NVMPROG 3
+#define UPDI_ASI_SYS_STATUS_UROWPROG 2
+#define UPDI_ASI_SYS_STATUS_LOCKSTATUS 0
+
+// ASI_CRC_STATUS values, as returned by updi_read_crc_status()
+#define UPDI_ASI_CRC_STATUS_MASK 0x07
+#define UPDI_ASI_CRC_STATUS_NOT_ENABLED 0x00
+#define UPDI_ASI_CRC_STATUS_BUSY 0x01
+#define UPDI_ASI_CRC_STATUS_OK 0x02
+#define UPDI_ASI_CRC_STATUS_FAILED 0x04
+
 #pragma pack(1)
 typedef struct {
     char family_id[7];
@@ -24,19 +43,59 @@ typedef enum {
     UPDIERR_WRITE_FAILED,
     UPDIERR_INVALID_SIZE,
     UPDIERR_TIMEOUT,
-    UPDIERR_NACK
+    UPDIERR_NACK,
+    UPDIERR_INVALID_OP,
+    UPDIERR_OVERRUN,
+    UPDIERR_ABORTED,
+    UPDIERR_UNSUPPORTED,
+    UPDIERR_VERIFY_FAILED,
+    UPDIERR_BUSY            // The target was still busy (e.g. the NVM controller) when the wait ran out
 } updi_err_t;
 
+// Link fault counters, since boot
+typedef struct {
+    uint16_t timeouts;
+    uint16_t nacks;
+    uint16_t overruns;
+    uint16_t breaks;
+    uint16_t resyncs;
+    uint16_t resync_failures;
+} updi_link_stats_t;
+
+typedef enum {
+    UPDI_KEYTYPE_NVM,
+    UPDI_KEYTYPE_CHIPERASE,
+    UPDI_KEYTYPE_UROW
+} updi_key_t;
+
 
 
-updi_err_t updi_send_break();
+void updi_init();
+void updi_break_hold();
+void updi_break_release();
+updi_err_t updi_break_done();
+bool updi_check_link();
+updi_err_t updi_raise_clock();
+bool updi_step_baud_up();
+uint8_t updi_baud_index();
+uint8_t updi_baud_fallback();
+bool updi_step_guard_down();
+void updi_link_defaults();
+updi_err_t updi_resync(updi_err_t cause);
+void updi_resync_finished(bool ok);
+const updi_link_stats_t *updi_link_stats();
 updi_err_t updi_get_sib(updi_sib_t *sib);
-updi_err_t updi_read_data(uint16_t address, uint8_t *out, uint8_t size);
-updi_err_t updi_read_user_row(uint8_t data[32]);
-updi_err_t updi_write_user_row(const uint8_t data[32]);
-updi_err_t updi_erase_chip();
-updi_err_t updi_enter_programming_mode();
-void updi_leave_programming_mode();
+updi_err_t updi_ld(uint32_t address, uint8_t *out);
+updi_err_t updi_st(uint32_t address, uint8_t data);
+updi_err_t updi_read_data(uint32_t address, uint8_t *out, uint16_t size);
+updi_err_t updi_write_data(uint32_t address, const uint8_t *data, uint16_t sz);
+updi_err_t updi_start_stream(uint32_t address);
+updi_err_t updi_read_stream(uint8_t *out, uint16_t size);
+updi_err_t updi_apply_key(updi_key_t key);
+updi_err_t updi_read_sys_status(uint8_t *status);
+updi_err_t updi_read_crc_status(uint8_t *status);
+void updi_user_row_finalize();
+void updi_user_row_release();
 void updi_reset_device();
 
 #endif // UPDI_H_
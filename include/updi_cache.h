@@ -0,0 +1,17 @@
+#ifndef UPDI_CACHE_H_
+#define UPDI_CACHE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "updi_op.h"
+
+typedef void (*updi_cache_done_t)(void);
+
+bool updi_cache_user_row(uint8_t *out, uint16_t *length);
+void updi_cache_op_complete(const updi_op_t *op, updi_err_t err);
+void updi_cache_invalidate();
+bool updi_cache_write_user_row(uint16_t offset, const uint8_t *data, uint16_t length);
+bool updi_cache_flush();
+void updi_cache_flush_then(updi_cache_done_t done);
+
+#endif // UPDI_CACHE_H_
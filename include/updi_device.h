@@ -0,0 +1,39 @@
+#ifndef UPDI_DEVICE_H_
+#define UPDI_DEVICE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "updi.h"
+
+// Signature row, same place on every UPDI part
+#define UPDI_SIGROW_ADDR 0x1100
+#define UPDI_SIGNATURE_SZ 3
+// Largest user row of any part in the table (megaAVR 0, AVR EA), for sizing buffers
+#define UPDI_MAX_USER_ROW_SZ 64
+// Largest flash page of any part in the table (AVR Dx)
+#define UPDI_MAX_PAGE_SZ 512
+
+/**
+ * Memory map of the connected target.  Addresses are UPDI data space addresses.
+ */
+typedef struct {
+    uint8_t signature[UPDI_SIGNATURE_SZ];
+    uint32_t flash_base;
+    uint32_t flash_size;
+    uint16_t flash_page_size;
+    uint16_t eeprom_base;
+    uint16_t eeprom_size;
+    // Largest chunk to write to EEPROM in one go.  On parts without an EEPROM page buffer it is only a transfer unit.
+    uint16_t eeprom_page_size;
+    uint16_t user_row_addr;
+    uint16_t user_row_size;
+    uint16_t fuse_base;
+} updi_device_t;
+
+const updi_device_t *updi_device_lookup(const uint8_t *signature);
+void updi_device_set_sib(const updi_sib_t *sib);
+const updi_device_t *updi_device();
+bool updi_device_user_row(uint16_t *addr, uint16_t *size);
+void updi_device_forget();
+
+#endif // UPDI_DEVICE_H_
@@ -0,0 +1,30 @@
+#ifndef UPDI_NVM_H_
+#define UPDI_NVM_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "updi.h"
+
+#define UPDI_NVM_VERSION_UNKNOWN 0xFF
+
+typedef enum {
+    UPDI_NVM_FLASH,
+    UPDI_NVM_EEPROM
+} updi_nvm_mem_t;
+
+updi_err_t updi_nvm_set_version(const updi_sib_t *sib);
+uint8_t updi_nvm_version();
+updi_err_t updi_nvm_busy(bool *busy, bool check_errors);
+updi_nvm_mem_t updi_nvm_user_row_mem();
+uint16_t updi_nvm_load_unit(updi_nvm_mem_t mem);
+updi_err_t updi_nvm_page_prepare(updi_nvm_mem_t mem, uint32_t address);
+updi_err_t updi_nvm_page_load(updi_nvm_mem_t mem, uint32_t address, const uint8_t *data, uint16_t len);
+updi_err_t updi_nvm_page_commit(updi_nvm_mem_t mem);
+updi_err_t updi_nvm_page_finish();
+updi_err_t updi_nvm_page_erase(updi_nvm_mem_t mem, uint32_t address);
+updi_err_t updi_nvm_chip_erase();
+updi_err_t updi_nvm_eeprom_erase();
+updi_err_t updi_nvm_scan_start();
+updi_err_t updi_nvm_scan_status(bool *busy);
+
+#endif // UPDI_NVM_H_
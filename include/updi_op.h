@@ -0,0 +1,74 @@
+#ifndef UPDI_OP_H_
+#define UPDI_OP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "updi.h"
+
+// Maximum number of operations that can be queued up behind the one in flight.
+#define UPDI_OP_QUEUE_SZ 4
+// Size of each REPEAT window in a streaming read.
+#define UPDI_STREAM_WINDOW 128
+
+// Page writes: read the page first, and leave it alone if it already holds what would be written.
+#define UPDI_OP_FLAG_DIFF 0x01
+// Set by the engine on a UPDI_OP_FLAG_DIFF page write that found the page already up to date.
+#define UPDI_OP_FLAG_UNCHANGED 0x02
+
+typedef enum {
+    UPDI_OP_CONNECT,            // Break, read the SIB into data (sizeof(updi_sib_t) bytes), then identify the part
+    UPDI_OP_READ,               // Read length bytes from address into data.  Enters programming mode first.
+    UPDI_OP_READ_STREAM,        // Read length bytes from address, handing them to sink a window at a time.  The only
+                                // op whose length can go past 16 bits, e.g. for the whole of a 128K flash.
+    UPDI_OP_READ_USER_ROW,      // Read the user row into data (UPDI_MAX_USER_ROW_SZ bytes), setting length
+    UPDI_OP_WRITE_USER_ROW,     // Write the user row from data, which must hold the part's user_row_size bytes
+    UPDI_OP_WRITE_FLASH_PAGE,   // Erase and write one flash page at address, from up to a page of data
+    UPDI_OP_WRITE_EEPROM_PAGE,  // Erase and write one EEPROM page at address, from up to a page of data
+    UPDI_OP_VERIFY_FLASH,       // Run the target's CRCSCAN over flash.  Fails with UPDIERR_VERIFY_FAILED on a mismatch.
+    UPDI_OP_VERIFY_FLASH_PAGE,  // Read back the flash page at address and compare it with data, as written by a page write
+    UPDI_OP_RESET               // Reset the target, dropping it out of programming mode
+} updi_op_type_t;
+
+struct updi_op;
+
+/**
+ * Consumer for a streaming read.  Called once per window, in order, with the offset from the start address.
+ * Return false to abort the read (the op then completes with UPDIERR_ABORTED).
+ */
+typedef bool (*updi_sink_t)(void *ctx, uint32_t offset, const uint8_t *data, uint16_t len);
+
+/**
+ * Called (from the kernel's message context) once an operation has finished, successfully or otherwise.
+ * The op passed in is a copy, so it is safe to submit further operations from inside the callback.
+ */
+typedef void (*updi_op_cb_t)(const struct updi_op *op, updi_err_t err);
+
+typedef struct updi_op {
+    updi_op_type_t type;
+    // UPDI data space address
+    uint32_t address;
+    uint32_t length;
+    // Source or destination buffer.  Must stay valid until the callback has been called.
+    uint8_t *data;
+    updi_op_cb_t cb;
+    // For UPDI_OP_READ_STREAM, where the data goes.  data is not used.
+    updi_sink_t sink;
+    // Caller context, passed back untouched in the callback (and the sink)
+    void *ctx;
+    // UPDI_OP_FLAG_*
+    uint8_t flags;
+
+    // Engine private state
+    uint32_t offset;
+    uint8_t step;
+    uint8_t polls;
+    uint8_t retries;
+    updi_err_t err;
+} updi_op_t;
+
+
+void updi_op_init();
+bool updi_op_submit(const updi_op_t *op);
+bool updi_op_busy();
+
+#endif // UPDI_OP_H_
@@ -61,24 +61,38 @@
 
 // d1 51 ab 07-9e d0-47 56-92 28-31 b1 64 a7 09 b0
 #define DEF_SVC1_USERROW_UUID_128     {0xb1, 0x09, 0xa7, 0x64, 0xb1, 0x31, 0x28, 0x92, 0x56, 0x47, 0xd0, 0x9e, 0x07, 0xab, 0x51, 0xd1}
-#define DEF_SVC1_USERROW_CHAR_MAX_LEN     1
+// Writes are an offset byte followed by the bytes to put there, so up to 1 + UPDI_MAX_USER_ROW_SZ
+#define DEF_SVC1_USERROW_CHAR_MAX_LEN     65
 #define DEF_SVC1_USERROW_USER_DESC "User Config"
 
-#define DEF_SVC1_SWITCH_TARGET_2_UUID_128     {0xb2, 0x09, 0xa7, 0x64, 0xb1, 0x31, 0x28, 0x92, 0x56, 0x47, 0xd0, 0x9e, 0x07, 0xab, 0x51, 0xd1}
-#define DEF_SVC1_SWITCH_TARGET_2_CHAR_MAX_LEN     1
-#define DEF_SVC1_SWITCH_TARGET_2_USER_DESC "Switch 2 Target"
+// Operation: id, opcode, address (4 bytes) and length (2 bytes), little endian.  See ble_ops.h.
+#define DEF_SVC1_OPERATION_UUID_128     {0xb2, 0x09, 0xa7, 0x64, 0xb1, 0x31, 0x28, 0x92, 0x56, 0x47, 0xd0, 0x9e, 0x07, 0xab, 0x51, 0xd1}
+#define DEF_SVC1_OPERATION_CHAR_MAX_LEN     8
+#define DEF_SVC1_OPERATION_USER_DESC "Operation"
 
-#define DEF_SVC1_SWITCH_TARGET_3_UUID_128     {0xb3, 0x09, 0xa7, 0x64, 0xb1, 0x31, 0x28, 0x92, 0x56, 0x47, 0xd0, 0x9e, 0x07, 0xab, 0x51, 0xd1}
-#define DEF_SVC1_SWITCH_TARGET_3_CHAR_MAX_LEN     1
-#define DEF_SVC1_SWITCH_TARGET_3_USER_DESC "Switch 3 Target"
+// Writes are a 2 byte offset followed by up to 128 bytes to put there.  Reads give back what the last read
+// operation fetched.
+#define DEF_SVC1_DATA_UUID_128     {0xb3, 0x09, 0xa7, 0x64, 0xb1, 0x31, 0x28, 0x92, 0x56, 0x47, 0xd0, 0x9e, 0x07, 0xab, 0x51, 0xd1}
+#define DEF_SVC1_DATA_CHAR_MAX_LEN     130
+#define DEF_SVC1_DATA_USER_DESC "Data"
 
-#define DEF_SVC1_SWITCH_TARGET_4_UUID_128     {0xb4, 0x09, 0xa7, 0x64, 0xb1, 0x31, 0x28, 0x92, 0x56, 0x47, 0xd0, 0x9e, 0x07, 0xab, 0x51, 0xd1}
-#define DEF_SVC1_SWITCH_TARGET_4_CHAR_MAX_LEN     1
-#define DEF_SVC1_SWITCH_TARGET_4_USER_DESC "Switch 4 Target"
+// Notified with the id of each operation as it completes, and its status.
+#define DEF_SVC1_RESULT_UUID_128     {0xb4, 0x09, 0xa7, 0x64, 0xb1, 0x31, 0x28, 0x92, 0x56, 0x47, 0xd0, 0x9e, 0x07, 0xab, 0x51, 0xd1}
+#define DEF_SVC1_RESULT_CHAR_MAX_LEN     2
+#define DEF_SVC1_RESULT_USER_DESC "Result"
 
-#define DEF_SVC1_SWITCH_TARGET_5_UUID_128     {0xb5, 0x09, 0xa7, 0x64, 0xb1, 0x31, 0x28, 0x92, 0x56, 0x47, 0xd0, 0x9e, 0x07, 0xab, 0x51, 0xd1}
-#define DEF_SVC1_SWITCH_TARGET_5_CHAR_MAX_LEN     1
-#define DEF_SVC1_SWITCH_TARGET_5_USER_DESC "Switch 5 Target"
+// Bulk: a whole page per packet once the MTU has been raised.  Writes are id, opcode, address (4 bytes) and the
+// page, and go straight out as a flash page write; reads give back what the last read operation fetched.  AVR DA/DB/DD
+// pages (512 bytes) don't fit, so those parts are refused here and have to use Operation and Data.
+#define DEF_SVC1_BULK_UUID_128     {0xb5, 0x09, 0xa7, 0x64, 0xb1, 0x31, 0x28, 0x92, 0x56, 0x47, 0xd0, 0x9e, 0x07, 0xab, 0x51, 0xd1}
+#define DEF_SVC1_BULK_CHAR_MAX_LEN     (USER_CFG_MAX_MTU - 3)
+#define DEF_SVC1_BULK_USER_DESC "Bulk"
+
+// Upload: image bytes streamed with Write Command, in order, against credits notified back on the same
+// characteristic.  See ble_upload.h.
+#define DEF_SVC1_UPLOAD_UUID_128     {0xb6, 0x09, 0xa7, 0x64, 0xb1, 0x31, 0x28, 0x92, 0x56, 0x47, 0xd0, 0x9e, 0x07, 0xab, 0x51, 0xd1}
+#define DEF_SVC1_UPLOAD_CHAR_MAX_LEN     (USER_CFG_MAX_MTU - 3)
+#define DEF_SVC1_UPLOAD_USER_DESC "Upload"
 
 
 /// Custom1 Service Data Base Characteristic enum
@@ -91,23 +105,27 @@ enum
     SVC1_IDX_USERROW_VAL,
     SVC1_IDX_USERROW_USER_DESC,
 
-    SVC1_IDX_SWITCH_TARGET_2_CHAR,
-    SVC1_IDX_SWITCH_TARGET_2_VAL,
-    SVC1_IDX_SWITCH_TARGET_2_USER_DESC,
-
-    SVC1_IDX_SWITCH_TARGET_3_CHAR,
-    SVC1_IDX_SWITCH_TARGET_3_VAL,
-    SVC1_IDX_SWITCH_TARGET_3_USER_DESC,
+    SVC1_IDX_OPERATION_CHAR,
+    SVC1_IDX_OPERATION_VAL,
+    SVC1_IDX_OPERATION_USER_DESC,
 
-    SVC1_IDX_SWITCH_TARGET_4_CHAR,
-    SVC1_IDX_SWITCH_TARGET_4_VAL,
-    SVC1_IDX_SWITCH_TARGET_4_USER_DESC,
+    SVC1_IDX_DATA_CHAR,
+    SVC1_IDX_DATA_VAL,
+    SVC1_IDX_DATA_USER_DESC,
 
-    SVC1_IDX_SWITCH_TARGET_5_CHAR,
-    SVC1_IDX_SWITCH_TARGET_5_VAL,
-    SVC1_IDX_SWITCH_TARGET_5_USER_DESC,
+    SVC1_IDX_RESULT_CHAR,
+    SVC1_IDX_RESULT_VAL,
+    SVC1_IDX_RESULT_NTF_CFG,
+    SVC1_IDX_RESULT_USER_DESC,
 
+    SVC1_IDX_BULK_CHAR,
+    SVC1_IDX_BULK_VAL,
+    SVC1_IDX_BULK_USER_DESC,
 
+    SVC1_IDX_UPLOAD_CHAR,
+    SVC1_IDX_UPLOAD_VAL,
+    SVC1_IDX_UPLOAD_NTF_CFG,
+    SVC1_IDX_UPLOAD_USER_DESC,
 
     CUSTS1_IDX_NB
 };
@@ -13,7 +13,13 @@
 #include <user_custs1_def.h>
 #include <gapm_task.h>
 #include <gapc_task.h>
+#include <gattc_task.h>
 #include "updi.h"
+#include "updi_op.h"
+#include "updi_device.h"
+#include "updi_cache.h"
+#include "ble_ops.h"
+#include "ble_upload.h"
 #include "user_app.h"
 
 #include <debug.h>
@@ -115,6 +121,25 @@ static const char* msgidToString(ke_msg_id_t msgid)
 }
 
 
+static void user_svc1_read_userrow_done(const updi_op_t *op, updi_err_t err)
+{
+    struct custs1_value_req_rsp *rsp = (struct custs1_value_req_rsp *) op->ctx;
+
+    if (err) {
+        DEBUG_PRINT_STRING("Error fetching UPDI ");
+        DEBUG_PRINT_INT(err);
+        DEBUG_PRINT_STRING("\r\n");
+        rsp->length = 0;
+        rsp->status  = ATT_ERR_APP_ERROR;
+    } else {
+        rsp->length  = op->length;
+        rsp->status  = ATT_ERR_NO_ERROR;
+    }
+
+    // Send message
+    ke_msg_send(rsp);
+}
+
 void user_svc1_read_userrow(ke_msg_id_t const msgid,
                             struct custs1_value_req_ind const *param,
                             ke_task_id_t const dest_id,
@@ -124,28 +149,52 @@ void user_svc1_read_userrow(ke_msg_id_t const msgid,
                                                         prf_get_task_from_id(TASK_ID_CUSTS1),
                                                         TASK_APP,
                                                         custs1_value_req_rsp,
-                                                        32);
+                                                        UPDI_MAX_USER_ROW_SZ);
     // Provide the connection index.
     rsp->conidx  = app_env[param->conidx].conidx;
     // Provide the attribute index.
     rsp->att_idx = param->att_idx;
 
+    uint16_t length;
+    if (updi_cache_user_row(rsp->value, &length)) {
+        rsp->length = length;
+        rsp->status  = ATT_ERR_NO_ERROR;
+        ke_msg_send(rsp);
+        return;
+    }
 
-    wdg_reload(200); // Give it up to 2000 ms to read the value.
-    rsp->length  = 32;
-    updi_err_t err = updi_read_user_row(rsp->value);
-    if (err) {
-        DEBUG_PRINT_STRING("Error fetching UPDI ");
-        DEBUG_PRINT_INT(err);
-        DEBUG_PRINT_STRING("\r\n");
+    // The response is held until the UPDI engine has read the row straight into it.
+    updi_op_t op = {
+        .type = UPDI_OP_READ_USER_ROW,
+        .data = rsp->value,
+        .cb = user_svc1_read_userrow_done,
+        .ctx = rsp,
+    };
+    if (!updi_op_submit(&op)) {
         rsp->length = 0;
         rsp->status  = ATT_ERR_APP_ERROR;
-    } else {
-        rsp->status  = ATT_ERR_NO_ERROR;
+        ke_msg_send(rsp);
     }
+}
 
-    // Send message
-    ke_msg_send(rsp);
+
+/**
+ * @brief A write to the user row characteristic is an offset byte followed by the bytes to put there.  The bytes
+ * are staged and written to the target later, all together.  A write of just the offset commits what has been
+ * staged so far.
+ */
+void user_svc1_write_userrow(struct custs1_val_write_ind const *param)
+{
+    if (param->length == 0) {
+        return;
+    }
+    if (param->length == 1) {
+        updi_cache_flush();
+        return;
+    }
+    if (!updi_cache_write_user_row(param->value[0], &param->value[1], param->length - 1)) {
+        DEBUG_PRINT_STRING("User row write out of range\r\n");
+    }
 }
 
 
@@ -163,6 +212,13 @@ void user_catch_rest_hndl(ke_msg_id_t const msgid, void const *param, ke_task_id
                 } 
                 break;
 
+                case SVC1_IDX_DATA_VAL:
+                case SVC1_IDX_BULK_VAL:
+                {
+                    ble_ops_read_data(msg_param);
+                }
+                break;
+
                 default:
                 {
                     // Send Error message
@@ -187,7 +243,40 @@ void user_catch_rest_hndl(ke_msg_id_t const msgid, void const *param, ke_task_id
         }
         break;
 
-        
+        case GATTC_MTU_CHANGED_IND:
+        {
+            struct gattc_mtu_changed_ind const *msg_param = (struct gattc_mtu_changed_ind const *)(param);
+            DEBUG_PRINT_STRING("MTU ");
+            DEBUG_PRINT_INT(msg_param->mtu);
+            DEBUG_PRINT_STRING("\r\n");
+        }
+        break;
+
+        case CUSTS1_VAL_WRITE_IND:
+        {
+            struct custs1_val_write_ind const *msg_param = (struct custs1_val_write_ind const *)(param);
+            switch (msg_param->handle) {
+                case SVC1_IDX_USERROW_VAL:
+                    user_svc1_write_userrow(msg_param);
+                    break;
+                case SVC1_IDX_OPERATION_VAL:
+                    ble_ops_write_operation(msg_param);
+                    break;
+                case SVC1_IDX_DATA_VAL:
+                    ble_ops_write_data(msg_param);
+                    break;
+                case SVC1_IDX_BULK_VAL:
+                    ble_ops_write_bulk(msg_param);
+                    break;
+                case SVC1_IDX_UPLOAD_VAL:
+                    ble_upload_write(msg_param);
+                    break;
+                default:
+                    break;
+            }
+        }
+        break;
+
         default:
         {
             // We are receiving a Generic Task Layer handler mssg. 
@@ -205,28 +294,82 @@ void user_catch_rest_hndl(ke_msg_id_t const msgid, void const *param, ke_task_id
     }
 }
 
-void user_on_connection(uint8_t connection_idx, struct gapc_connection_req_ind const *param)
-{
-    DEBUG_PRINT_STRING("user_on_connection()\r\n");
-    default_app_on_connection(connection_idx, param);
+static updi_sib_t sib;
 
-
-    updi_send_break();
-    updi_sib_t sib;
-    updi_err_t err = updi_get_sib(&sib);
+static void user_on_updi_connected(const updi_op_t *op, updi_err_t err)
+{
     if (err) {
         DEBUG_PRINT_STRING("Error getting SIB\r\n");
+        return;
     }
     DEBUG_PRINT_STRING("SIB ");
     DEBUG_PRINT_STRING((char *) &sib);
     DEBUG_PRINT_STRING("\r\n");
+}
+
+/**
+ * @brief Asks the client for the largest MTU we support.  Most clients would get round to it themselves, but not
+ * all of them do it straight away, and nothing moves a page at a time until it's done.
+ */
+static void user_exchange_mtu(uint8_t conidx)
+{
+    struct gattc_exc_mtu_cmd *cmd = KE_MSG_ALLOC(GATTC_EXC_MTU_CMD,
+                                                 KE_BUILD_ID(TASK_GATTC, conidx),
+                                                 TASK_APP,
+                                                 gattc_exc_mtu_cmd);
+    cmd->operation = GATTC_MTU_EXCH;
+    cmd->seq_num = 0;
+    ke_msg_send(cmd);
+}
+
+void user_on_connection(uint8_t connection_idx, struct gapc_connection_req_ind const *param)
+{
+    DEBUG_PRINT_STRING("user_on_connection()\r\n");
+    default_app_on_connection(connection_idx, param);
+    ble_ops_connected(app_env[connection_idx].conidx);
+    ble_upload_connected(app_env[connection_idx].conidx);
 
+    // Bulk transfers want a page per packet: full length link layer packets, and an MTU to match.
+    app_easy_gap_set_data_packet_length(connection_idx, USER_CFG_MAX_TX_OCTETS, USER_CFG_MAX_TX_TIME);
+    user_exchange_mtu(app_env[connection_idx].conidx);
+
+    updi_op_t op = {
+        .type = UPDI_OP_CONNECT,
+        .data = (uint8_t *) &sib,
+        .cb = user_on_updi_connected,
+    };
+    updi_op_submit(&op);
+}
+
+void user_on_data_length_change(uint8_t connection_idx, struct gapc_le_pkt_size_ind *param)
+{
+    DEBUG_PRINT_STRING("Data length tx ");
+    DEBUG_PRINT_INT(param->max_tx_octets);
+    DEBUG_PRINT_STRING(" rx ");
+    DEBUG_PRINT_INT(param->max_rx_octets);
+    DEBUG_PRINT_STRING("\r\n");
+}
+
+/**
+ * @brief Ends the target's session once any staged user row changes have gone out.
+ */
+static void user_on_disconnect_flushed()
+{
+    // Queued behind anything still in flight, so we don't reset the target halfway through a write.
+    updi_op_t op = {
+        .type = UPDI_OP_RESET,
+    };
+    updi_op_submit(&op);
 }
 
 void user_on_disconnect( struct gapc_disconnect_ind const *param )
 {
     DEBUG_PRINT_STRING("user_on_disconnect()\r\n");
     default_app_on_disconnect(param);
+    ble_ops_disconnected();
+    ble_upload_disconnected();
 
-    updi_reset_device();
+    // Staged user row changes go out before the reset that ends the session.  The flush may have to read the
+    // row before it can write it, so the reset waits until it's done.
+    updi_cache_flush_then(user_on_disconnect_flushed);
 }
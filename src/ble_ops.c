@@ -0,0 +1,315 @@
+#include "ble_ops.h"
+
+#include <da1458x_config_basic.h>
+#include <da1458x_config_advanced.h>
+#include <user_config.h>
+#include <rwip_config.h>
+#include "prf_utils.h"
+
+#include <string.h>
+#include <ke_msg.h>
+#include <ke_mem.h>
+#include <app.h>
+#include <custs1.h>
+#include <custs1_task.h>
+#include <user_custs1_def.h>
+#include "updi_op.h"
+#include "updi_nvm.h"
+#include "ble_upload.h"
+
+#include <debug.h>
+
+// Most a read can fetch: all of it has to come back in one read of the Data characteristic.
+#define BLE_OPS_READ_MAX DEF_SVC1_DATA_CHAR_MAX_LEN
+
+/**
+ * What we keep of an operation while it's queued: the client's id, and a copy of its data (or somewhere for the
+ * data to go).  Allocated from the non-retained heap, as nothing here survives a disconnect anyway.
+ */
+typedef struct {
+    uint8_t id;
+    uint8_t opcode;
+    uint16_t length;
+    uint8_t data[];
+} ble_op_ctx_t;
+
+// Written a chunk at a time through the Data characteristic, and copied out by the operation that uses it.
+static uint8_t ble_ops_staged[BLE_OPS_DATA_MAX];
+// The last read's context, kept so the Data characteristic can be read back.  NULL if there's nothing to read.
+static ble_op_ctx_t *ble_ops_result;
+static uint8_t ble_ops_conidx;
+static bool ble_ops_link;
+
+
+static ble_op_ctx_t *ble_ops_alloc(uint8_t id, uint8_t opcode, uint16_t length) {
+    if (!ke_check_malloc(sizeof(ble_op_ctx_t) + length, KE_MEM_NON_RETENTION)) {
+        return NULL;
+    }
+    ble_op_ctx_t *ctx = ke_malloc(sizeof(ble_op_ctx_t) + length, KE_MEM_NON_RETENTION);
+    ctx->id = id;
+    ctx->opcode = opcode;
+    ctx->length = length;
+    return ctx;
+}
+
+static void ble_ops_set_result(ble_op_ctx_t *ctx) {
+    if (ble_ops_result) {
+        ke_free(ble_ops_result);
+    }
+    ble_ops_result = ctx;
+}
+
+/**
+ * @brief Reports the outcome of operation id on the Result characteristic.
+ */
+void ble_ops_notify(uint8_t id, uint8_t status) {
+    if (!ble_ops_link) {
+        return;
+    }
+    struct custs1_val_ntf_ind_req *req = KE_MSG_ALLOC_DYN(CUSTS1_VAL_NTF_REQ,
+                                                          prf_get_task_from_id(TASK_ID_CUSTS1),
+                                                          TASK_APP,
+                                                          custs1_val_ntf_ind_req,
+                                                          DEF_SVC1_RESULT_CHAR_MAX_LEN);
+    req->conidx = ble_ops_conidx;
+    req->notification = true;
+    req->handle = SVC1_IDX_RESULT_VAL;
+    req->length = DEF_SVC1_RESULT_CHAR_MAX_LEN;
+    req->value[0] = id;
+    req->value[1] = status;
+    ke_msg_send(req);
+}
+
+static void ble_ops_done(const updi_op_t *op, updi_err_t err) {
+    ble_op_ctx_t *ctx = (ble_op_ctx_t *) op->ctx;
+    uint8_t id = ctx->id;
+
+    if (!err && (ctx->opcode == BLE_OP_READ || ctx->opcode == BLE_OP_CONNECT) && ble_ops_link) {
+        ble_ops_set_result(ctx);
+    } else {
+        ke_free(ctx);
+    }
+    ble_ops_notify(id, err);
+}
+
+/**
+ * @brief Answers BLE_OP_DEVICE_INFO straight away, from what the connect worked out.
+ */
+static uint8_t ble_ops_device_info(uint8_t id) {
+    const updi_device_t *dev = updi_device();
+    if (!dev) {
+        return BLE_OP_STATUS_NO_DEVICE;
+    }
+    ble_op_ctx_t *ctx = ble_ops_alloc(id, BLE_OP_DEVICE_INFO, sizeof(ble_op_device_info_t));
+    if (!ctx) {
+        return BLE_OP_STATUS_BUSY;
+    }
+    ble_op_device_info_t info;
+    memcpy(info.signature, dev->signature, UPDI_SIGNATURE_SZ);
+    info.nvm_version = updi_nvm_version();
+    info.flash_base = dev->flash_base;
+    info.flash_size = dev->flash_size;
+    info.flash_page_size = dev->flash_page_size;
+    info.eeprom_base = dev->eeprom_base;
+    info.eeprom_size = dev->eeprom_size;
+    info.eeprom_page_size = dev->eeprom_page_size;
+    info.user_row_addr = dev->user_row_addr;
+    info.user_row_size = dev->user_row_size;
+    memcpy(ctx->data, &info, sizeof(info));
+    ble_ops_set_result(ctx);
+    return UPDI_OK;
+}
+
+/**
+ * @brief Turns an operation from the client into an op for the UPDI engine, and queues it.
+ *
+ * @param src where operations that write (or compare) take their data from
+ * @param diff BLE_OP_FLAG_DIFF was given, which only page writes and upload starts take
+ * @return UPDI_OK if it was queued (the result follows when it completes), otherwise the status to report now.
+ */
+static uint8_t ble_ops_submit(uint8_t id, uint8_t opcode, uint32_t address, uint16_t length, const uint8_t *src,
+                              bool diff) {
+    updi_op_t op = {
+        .address = address,
+        .length = length,
+        .cb = ble_ops_done,
+    };
+    bool staged = false;
+
+    if (diff && opcode != BLE_OP_WRITE_FLASH && opcode != BLE_OP_WRITE_EEPROM && opcode != BLE_OP_UPLOAD_START &&
+            opcode != BLE_OP_UPLOAD_START_HS) {
+        return BLE_OP_STATUS_INVALID;
+    }
+    if (diff) {
+        op.flags = UPDI_OP_FLAG_DIFF;
+    }
+
+    switch (opcode) {
+        case BLE_OP_READ:
+            op.type = UPDI_OP_READ;
+            break;
+        case BLE_OP_WRITE_FLASH:
+            op.type = UPDI_OP_WRITE_FLASH_PAGE;
+            staged = true;
+            break;
+        case BLE_OP_WRITE_EEPROM:
+            op.type = UPDI_OP_WRITE_EEPROM_PAGE;
+            staged = true;
+            break;
+        case BLE_OP_VERIFY_PAGE:
+            op.type = UPDI_OP_VERIFY_FLASH_PAGE;
+            staged = true;
+            break;
+        case BLE_OP_VERIFY_FLASH:
+            op.type = UPDI_OP_VERIFY_FLASH;
+            op.length = 0;
+            break;
+        case BLE_OP_RESET:
+            op.type = UPDI_OP_RESET;
+            op.length = 0;
+            break;
+        case BLE_OP_CONNECT:
+            op.type = UPDI_OP_CONNECT;
+            op.length = sizeof(updi_sib_t);
+            break;
+        case BLE_OP_DEVICE_INFO:
+            return ble_ops_device_info(id);
+        case BLE_OP_UPLOAD_START:
+            return ble_upload_start(id, address, false, diff);
+        case BLE_OP_UPLOAD_START_HS:
+            return ble_upload_start(id, address, true, diff);
+        case BLE_OP_UPLOAD_END:
+            return ble_upload_end(id);
+        default:
+            return BLE_OP_STATUS_INVALID;
+    }
+
+    if ((op.type == UPDI_OP_READ || staged) && (op.length == 0 || op.length > BLE_OPS_DATA_MAX)) {
+        return BLE_OP_STATUS_INVALID;
+    }
+    if (op.type == UPDI_OP_READ && op.length > BLE_OPS_READ_MAX) {
+        return BLE_OP_STATUS_INVALID;
+    }
+
+    ble_op_ctx_t *ctx = ble_ops_alloc(id, opcode, op.length);
+    if (!ctx) {
+        return BLE_OP_STATUS_BUSY;
+    }
+    if (staged) {
+        memcpy(ctx->data, src, op.length);
+    }
+    op.data = ctx->data;
+    op.ctx = ctx;
+
+    if (!updi_op_submit(&op)) {
+        ke_free(ctx);
+        return BLE_OP_STATUS_BUSY;
+    }
+    return UPDI_OK;
+}
+
+void ble_ops_write_operation(struct custs1_val_write_ind const *param) {
+    if (param->length < DEF_SVC1_OPERATION_CHAR_MAX_LEN) {
+        return;
+    }
+    const uint8_t *v = param->value;
+    uint8_t id = v[0];
+    uint8_t opcode = v[1] & ~BLE_OP_FLAG_DIFF;
+    bool diff = (v[1] & BLE_OP_FLAG_DIFF) != 0;
+    uint32_t address = v[2] | ((uint32_t) v[3] << 8) | ((uint32_t) v[4] << 16) | ((uint32_t) v[5] << 24);
+    uint16_t length = v[6] | (v[7] << 8);
+
+    uint8_t status = ble_ops_submit(id, opcode, address, length, ble_ops_staged, diff);
+    // Queued ones report when they finish; anything else is reported now.
+    if (status != UPDI_OK || opcode == BLE_OP_DEVICE_INFO || opcode == BLE_OP_UPLOAD_START ||
+            opcode == BLE_OP_UPLOAD_START_HS) {
+        ble_ops_notify(id, status);
+    }
+}
+
+/**
+ * @brief A write to the Data characteristic is a 2 byte offset followed by the bytes to put there, staged for
+ * the next operation that needs data.
+ */
+void ble_ops_write_data(struct custs1_val_write_ind const *param) {
+    if (param->length < 2) {
+        return;
+    }
+    uint16_t offset = param->value[0] | (param->value[1] << 8);
+    uint16_t length = param->length - 2;
+    if (offset > BLE_OPS_DATA_MAX || length > BLE_OPS_DATA_MAX - offset) {
+        DEBUG_PRINT_STRING("Data write out of range\r\n");
+        return;
+    }
+    memcpy(&ble_ops_staged[offset], &param->value[2], length);
+}
+
+/**
+ * @brief A write to the Bulk characteristic is a whole flash page, which is written as soon as it arrives: id,
+ * opcode (BLE_OP_WRITE_FLASH, with or without BLE_OP_FLAG_DIFF), address (4 bytes) then the page.  Its result is
+ * notified like any other operation's.
+ *
+ * Only parts whose page fits in one write can use it (tinyAVR and megaAVR 0, and AVR EA).  Anything else would
+ * have its page erased and only partly written, so it is refused and has to go through the Data characteristic.
+ */
+void ble_ops_write_bulk(struct custs1_val_write_ind const *param) {
+    if (param->length <= BLE_OPS_BULK_HDR_SZ) {
+        return;
+    }
+    const uint8_t *v = param->value;
+    uint8_t id = v[0];
+    uint8_t opcode = v[1] & ~BLE_OP_FLAG_DIFF;
+    bool diff = (v[1] & BLE_OP_FLAG_DIFF) != 0;
+    uint32_t address = v[2] | ((uint32_t) v[3] << 8) | ((uint32_t) v[4] << 16) | ((uint32_t) v[5] << 24);
+    const updi_device_t *dev = updi_device();
+    uint8_t status;
+
+    if (opcode != BLE_OP_WRITE_FLASH) {
+        status = BLE_OP_STATUS_INVALID;
+    } else if (!dev) {
+        status = BLE_OP_STATUS_NO_DEVICE;
+    } else if (dev->flash_page_size > DEF_SVC1_BULK_CHAR_MAX_LEN - BLE_OPS_BULK_HDR_SZ) {
+        status = BLE_OP_STATUS_INVALID;
+    } else {
+        status = ble_ops_submit(id, BLE_OP_WRITE_FLASH, address, param->length - BLE_OPS_BULK_HDR_SZ,
+                                &v[BLE_OPS_BULK_HDR_SZ], diff);
+    }
+    if (status != UPDI_OK) {
+        ble_ops_notify(id, status);
+    }
+}
+
+/**
+ * @brief Reads of the Data (or Bulk) characteristic give back whatever the last read (or device info) fetched.
+ */
+void ble_ops_read_data(struct custs1_value_req_ind const *param) {
+    uint16_t length = ble_ops_result ? ble_ops_result->length : 0;
+    struct custs1_value_req_rsp *rsp = KE_MSG_ALLOC_DYN(CUSTS1_VALUE_REQ_RSP,
+                                                        prf_get_task_from_id(TASK_ID_CUSTS1),
+                                                        TASK_APP,
+                                                        custs1_value_req_rsp,
+                                                        length);
+    rsp->conidx = app_env[param->conidx].conidx;
+    rsp->att_idx = param->att_idx;
+    rsp->length = length;
+    rsp->status = ATT_ERR_NO_ERROR;
+    if (length) {
+        memcpy(rsp->value, ble_ops_result->data, length);
+    }
+    ke_msg_send(rsp);
+}
+
+void ble_ops_connected(uint8_t conidx) {
+    ble_ops_conidx = conidx;
+    ble_ops_link = true;
+    memset(ble_ops_staged, 0xFF, sizeof(ble_ops_staged));
+}
+
+/**
+ * @brief Drops everything the client left behind.  Operations still queued run to completion, but their
+ * results go nowhere.
+ */
+void ble_ops_disconnected() {
+    ble_ops_link = false;
+    ble_ops_set_result(NULL);
+}
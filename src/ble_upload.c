@@ -0,0 +1,318 @@
+#include "ble_upload.h"
+
+#include <da1458x_config_basic.h>
+#include <da1458x_config_advanced.h>
+#include <user_config.h>
+#include <rwip_config.h>
+#include "prf_utils.h"
+
+#include <string.h>
+#include <ke_msg.h>
+#include <ke_mem.h>
+#include <custs1.h>
+#include <custs1_task.h>
+#include <user_custs1_def.h>
+#include <app_easy_timer.h>
+#include "updi_op.h"
+#include "updi_device.h"
+#include "ble_ops.h"
+#include "hs_decoder.h"
+
+#include <debug.h>
+
+// How long to wait before trying again when the op queue is full
+#define BLE_UPLOAD_RETRY_TICKS 1
+
+/**
+ * A write held in the queue.  These live in the kernel message heap, which is sized for exactly this sort of
+ * traffic, and go back as soon as their bytes have been copied into the page.
+ */
+typedef struct {
+    uint16_t length;
+    uint8_t data[];
+} ble_upload_pkt_t;
+
+static ble_upload_pkt_t *ble_upload_queue[BLE_UPLOAD_QUEUE_SZ];
+static uint8_t ble_upload_head;
+static uint8_t ble_upload_count;
+// How much of the packet at the head has already gone into the page
+static uint16_t ble_upload_consumed;
+// Credits owed to the client, for packets we've finished with
+static uint8_t ble_upload_credits;
+
+/**
+ * Page buffers, used in turn.  The oldest ble_upload_inflight of them are with the UPDI engine (which finishes
+ * them in order); the one after those is being filled.  So the next page keeps coming in over BLE while the
+ * last one is written, and the client is only held up once every buffer is taken.
+ */
+static uint8_t ble_upload_pages[BLE_UPLOAD_PAGES][UPDI_MAX_PAGE_SZ];
+static uint8_t ble_upload_oldest;
+static uint8_t ble_upload_inflight;
+static uint16_t ble_upload_page_size;
+static uint16_t ble_upload_fill;
+// Where the page being filled goes
+static uint32_t ble_upload_address;
+
+static bool ble_upload_active;
+static bool ble_upload_ending;
+// The image is heatshrink compressed, and is unpacked on its way into the pages
+static bool ble_upload_compressed;
+static hs_decoder_t ble_upload_decoder;
+// Pages are written with UPDI_OP_FLAG_DIFF
+static bool ble_upload_diff;
+static uint8_t ble_upload_id;
+static uint8_t ble_upload_end_id;
+static timer_hnd ble_upload_timer = EASY_TIMER_INVALID_TIMER;
+
+static uint8_t ble_upload_conidx;
+static bool ble_upload_link;
+
+
+static void ble_upload_pump();
+
+static void ble_upload_notify_credits() {
+    if (!ble_upload_credits) {
+        return;
+    }
+    if (ble_upload_link) {
+        struct custs1_val_ntf_ind_req *req = KE_MSG_ALLOC_DYN(CUSTS1_VAL_NTF_REQ,
+                                                              prf_get_task_from_id(TASK_ID_CUSTS1),
+                                                              TASK_APP,
+                                                              custs1_val_ntf_ind_req,
+                                                              1);
+        req->conidx = ble_upload_conidx;
+        req->notification = true;
+        req->handle = SVC1_IDX_UPLOAD_VAL;
+        req->length = 1;
+        req->value[0] = ble_upload_credits;
+        ke_msg_send(req);
+    }
+    ble_upload_credits = 0;
+}
+
+static void ble_upload_pop() {
+    ke_free(ble_upload_queue[ble_upload_head]);
+    ble_upload_queue[ble_upload_head] = NULL;
+    ble_upload_head = (ble_upload_head + 1) % BLE_UPLOAD_QUEUE_SZ;
+    ble_upload_count--;
+    ble_upload_consumed = 0;
+    ble_upload_credits++;
+}
+
+static void ble_upload_drop_queue() {
+    while (ble_upload_count) {
+        ble_upload_pop();
+    }
+    ble_upload_credits = 0;
+}
+
+static void ble_upload_cancel_timer() {
+    if (ble_upload_timer != EASY_TIMER_INVALID_TIMER) {
+        app_easy_timer_cancel(ble_upload_timer);
+        ble_upload_timer = EASY_TIMER_INVALID_TIMER;
+    }
+}
+
+/**
+ * @brief Gives up on the upload, reporting err against the START id, and the END id too if one is waiting.
+ */
+static void ble_upload_fail(uint8_t err) {
+    DEBUG_PRINT_STRING("Upload failed ");
+    DEBUG_PRINT_INT(err);
+    DEBUG_PRINT_STRING("\r\n");
+    ble_upload_active = false;
+    ble_upload_cancel_timer();
+    ble_upload_drop_queue();
+    ble_ops_notify(ble_upload_id, err);
+    if (ble_upload_ending) {
+        ble_ops_notify(ble_upload_end_id, err);
+    }
+}
+
+static void ble_upload_page_done(const updi_op_t *op, updi_err_t err) {
+    ble_upload_inflight--;
+    ble_upload_oldest = (ble_upload_oldest + 1) % BLE_UPLOAD_PAGES;
+    if (!ble_upload_active) {
+        return;
+    }
+    if (err) {
+        ble_upload_fail(err);
+        return;
+    }
+    ble_upload_pump();
+}
+
+/**
+ * @brief Moves the next run of bytes from the queue into the page, unpacking them first if need be.
+ *
+ * @return false if nothing could be moved, i.e. more has to arrive first.
+ */
+static bool ble_upload_fill_page(uint8_t *page) {
+    const uint8_t *in = NULL;
+    uint16_t in_len = 0;
+    uint16_t room = ble_upload_page_size - ble_upload_fill;
+    uint16_t used;
+    uint16_t n;
+
+    if (ble_upload_count) {
+        ble_upload_pkt_t *pkt = ble_upload_queue[ble_upload_head];
+        in = &pkt->data[ble_upload_consumed];
+        in_len = pkt->length - ble_upload_consumed;
+    }
+
+    if (ble_upload_compressed) {
+        // Even with no input there may be the rest of a back reference to come out.
+        n = hs_decoder_run(&ble_upload_decoder, in, in_len, &used, &page[ble_upload_fill], room);
+    } else {
+        if (!in_len) {
+            return false;
+        }
+        n = in_len < room ? in_len : room;
+        memcpy(&page[ble_upload_fill], in, n);
+        used = n;
+    }
+    if (!n && !used) {
+        return false;
+    }
+
+    ble_upload_fill += n;
+    if (ble_upload_count && used == in_len) {
+        ble_upload_pop();
+    } else {
+        ble_upload_consumed += used;
+    }
+    return true;
+}
+
+static void ble_upload_timer_cb() {
+    ble_upload_timer = EASY_TIMER_INVALID_TIMER;
+    ble_upload_pump();
+}
+
+/**
+ * @brief Moves queued bytes into the free page buffer, and hands each page to the engine once it's full (or the
+ * upload is ending).  Credits are returned as the packets they came from are used up.
+ */
+static void ble_upload_pump() {
+    while (ble_upload_active && ble_upload_inflight < BLE_UPLOAD_PAGES) {
+        uint8_t *page = ble_upload_pages[(ble_upload_oldest + ble_upload_inflight) % BLE_UPLOAD_PAGES];
+        while (ble_upload_fill < ble_upload_page_size && ble_upload_fill_page(page));
+
+        bool last = ble_upload_ending && !ble_upload_count &&
+            !(ble_upload_compressed && hs_decoder_pending(&ble_upload_decoder));
+        if (ble_upload_fill == ble_upload_page_size || (last && ble_upload_fill)) {
+            updi_op_t op = {
+                .type = UPDI_OP_WRITE_FLASH_PAGE,
+                .address = ble_upload_address,
+                .length = ble_upload_fill,
+                .data = page,
+                .cb = ble_upload_page_done,
+                .flags = ble_upload_diff ? UPDI_OP_FLAG_DIFF : 0,
+            };
+            if (!updi_op_submit(&op)) {
+                if (ble_upload_timer == EASY_TIMER_INVALID_TIMER) {
+                    ble_upload_timer = app_easy_timer(BLE_UPLOAD_RETRY_TICKS, ble_upload_timer_cb);
+                }
+                break;
+            }
+            ble_upload_inflight++;
+            ble_upload_address += ble_upload_page_size;
+            ble_upload_fill = 0;
+            continue;
+        }
+
+        if (last && !ble_upload_inflight) {
+            ble_upload_active = false;
+            ble_ops_notify(ble_upload_end_id, UPDI_OK);
+        }
+        break;
+    }
+
+    if (ble_upload_credits >= BLE_UPLOAD_CREDIT_BATCH || (ble_upload_credits && !ble_upload_count)) {
+        ble_upload_notify_credits();
+    }
+}
+
+/**
+ * @brief Opens an upload to the flash page at address.
+ *
+ * @param compressed whether the image comes heatshrink compressed (see hs_decoder.h)
+ * @param diff whether pages that already hold what would be written are skipped (BLE_OP_FLAG_DIFF)
+ * @return UPDI_OK, or the BLE_OP_STATUS_* to report
+ */
+uint8_t ble_upload_start(uint8_t id, uint32_t address, bool compressed, bool diff) {
+    const updi_device_t *dev = updi_device();
+    if (!dev) {
+        return BLE_OP_STATUS_NO_DEVICE;
+    }
+    if (ble_upload_active || ble_upload_inflight) {
+        return BLE_OP_STATUS_BUSY;
+    }
+    if (dev->flash_page_size > UPDI_MAX_PAGE_SZ || address % dev->flash_page_size) {
+        return BLE_OP_STATUS_INVALID;
+    }
+
+    ble_upload_drop_queue();
+    ble_upload_page_size = dev->flash_page_size;
+    ble_upload_fill = 0;
+    ble_upload_address = address;
+    ble_upload_id = id;
+    ble_upload_ending = false;
+    ble_upload_compressed = compressed;
+    ble_upload_diff = diff;
+    if (compressed) {
+        hs_decoder_reset(&ble_upload_decoder);
+    }
+    ble_upload_active = true;
+
+    ble_upload_credits = BLE_UPLOAD_QUEUE_SZ;
+    ble_upload_notify_credits();
+    return UPDI_OK;
+}
+
+/**
+ * @brief Marks the end of the image.  The result for id is notified once the last page is in.
+ */
+uint8_t ble_upload_end(uint8_t id) {
+    if (!ble_upload_active || ble_upload_ending) {
+        return BLE_OP_STATUS_INVALID;
+    }
+    ble_upload_end_id = id;
+    ble_upload_ending = true;
+    ble_upload_pump();
+    return UPDI_OK;
+}
+
+void ble_upload_write(struct custs1_val_write_ind const *param) {
+    if (!ble_upload_active || ble_upload_ending || !param->length) {
+        return;
+    }
+    if (ble_upload_count >= BLE_UPLOAD_QUEUE_SZ ||
+            !ke_check_malloc(sizeof(ble_upload_pkt_t) + param->length, KE_MEM_KE_MSG)) {
+        // The client has run past its credits.  The stream now has a hole in it, so there's no carrying on.
+        ble_upload_fail(UPDIERR_OVERRUN);
+        return;
+    }
+
+    ble_upload_pkt_t *pkt = ke_malloc(sizeof(ble_upload_pkt_t) + param->length, KE_MEM_KE_MSG);
+    pkt->length = param->length;
+    memcpy(pkt->data, param->value, param->length);
+    ble_upload_queue[(ble_upload_head + ble_upload_count) % BLE_UPLOAD_QUEUE_SZ] = pkt;
+    ble_upload_count++;
+    ble_upload_pump();
+}
+
+void ble_upload_connected(uint8_t conidx) {
+    ble_upload_conidx = conidx;
+    ble_upload_link = true;
+}
+
+/**
+ * @brief Abandons any upload in progress.  A page already handed to the engine is still written.
+ */
+void ble_upload_disconnected() {
+    ble_upload_link = false;
+    ble_upload_active = false;
+    ble_upload_cancel_timer();
+    ble_upload_drop_queue();
+}
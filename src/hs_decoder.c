@@ -0,0 +1,131 @@
+#include "hs_decoder.h"
+#include <string.h>
+
+/**
+ * The stream is a run of tagged items, bit packed, most significant bit first:
+ *   1, then 8 bits:  a literal byte
+ *   0, then HS_WINDOW_BITS of (distance back - 1), then HS_LOOKAHEAD_BITS of (length - 1):  a back reference
+ * The window starts out as zeros, and anything left over in the last byte is padding.
+ */
+
+#define HS_WINDOW_MASK (HS_WINDOW_SZ - 1)
+
+enum {
+    HS_TAG,
+    HS_LITERAL,
+    HS_BR_INDEX,
+    HS_BR_COUNT,
+    HS_BR_YIELD,
+};
+
+#define HS_NO_BITS 0xFFFF
+
+
+void hs_decoder_reset(hs_decoder_t *hs) {
+    memset(hs->window, 0, sizeof(hs->window));
+    hs->head = 0;
+    hs->bits = 0;
+    hs->bit_count = 0;
+    hs->state = HS_TAG;
+    hs->index = 0;
+    hs->count = 0;
+}
+
+/**
+ * @brief Takes n (up to 8) bits off the input.
+ *
+ * @return the bits, or HS_NO_BITS if the input ran out first (what there was is kept for next time).
+ */
+static uint16_t hs_get_bits(hs_decoder_t *hs, uint8_t n, const uint8_t **in, const uint8_t *end) {
+    if (hs->bit_count < n) {
+        if (*in == end) {
+            return HS_NO_BITS;
+        }
+        hs->bits = (hs->bits << 8) | *(*in)++;
+        hs->bit_count += 8;
+    }
+    hs->bit_count -= n;
+    return (hs->bits >> hs->bit_count) & ((1 << n) - 1);
+}
+
+static inline void hs_emit(hs_decoder_t *hs, uint8_t byte, uint8_t **out) {
+    hs->window[hs->head] = byte;
+    hs->head = (hs->head + 1) & HS_WINDOW_MASK;
+    *(*out)++ = byte;
+}
+
+/**
+ * @brief Decodes as much as it can: until the input is used up, or the output is full.  Either way it picks up
+ * where it left off on the next call, so the input and output can be split anywhere.
+ *
+ * @param in_used set to how many bytes of in were consumed
+ * @return the number of bytes written to out
+ */
+uint16_t hs_decoder_run(hs_decoder_t *hs, const uint8_t *in, uint16_t in_len, uint16_t *in_used,
+                        uint8_t *out, uint16_t out_len) {
+    const uint8_t *in_start = in;
+    const uint8_t *in_end = in + in_len;
+    uint8_t *out_start = out;
+    uint8_t *out_end = out + out_len;
+    uint16_t v;
+
+    while (out < out_end) {
+        switch (hs->state) {
+            case HS_TAG:
+                v = hs_get_bits(hs, 1, &in, in_end);
+                if (v == HS_NO_BITS) {
+                    goto done;
+                }
+                hs->state = v ? HS_LITERAL : HS_BR_INDEX;
+                break;
+
+            case HS_LITERAL:
+                v = hs_get_bits(hs, 8, &in, in_end);
+                if (v == HS_NO_BITS) {
+                    goto done;
+                }
+                hs_emit(hs, v, &out);
+                hs->state = HS_TAG;
+                break;
+
+            case HS_BR_INDEX:
+                v = hs_get_bits(hs, HS_WINDOW_BITS, &in, in_end);
+                if (v == HS_NO_BITS) {
+                    goto done;
+                }
+                hs->index = v + 1;
+                hs->state = HS_BR_COUNT;
+                break;
+
+            case HS_BR_COUNT:
+                v = hs_get_bits(hs, HS_LOOKAHEAD_BITS, &in, in_end);
+                if (v == HS_NO_BITS) {
+                    goto done;
+                }
+                hs->count = v + 1;
+                hs->state = HS_BR_YIELD;
+                break;
+
+            case HS_BR_YIELD:
+                while (hs->count && out < out_end) {
+                    hs_emit(hs, hs->window[(hs->head - hs->index) & HS_WINDOW_MASK], &out);
+                    hs->count--;
+                }
+                if (!hs->count) {
+                    hs->state = HS_TAG;
+                }
+                break;
+        }
+    }
+
+done:
+    *in_used = in - in_start;
+    return out - out_start;
+}
+
+/**
+ * @brief Whether there is output still to come without any more input (the rest of a back reference).
+ */
+bool hs_decoder_pending(const hs_decoder_t *hs) {
+    return hs->state == HS_BR_YIELD;
+}
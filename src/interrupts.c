@@ -22,15 +22,6 @@ void IRQ_UART_Handler(void)
     }
 }
 
-void IRQ_UART2_Handler(void)
-{
-    __BKPT(0);
-    while (1)
-    {
-        __NOP();
-    }
-}
-
 void IRQ_I2C_Handler(void)
 {
     __BKPT(0);
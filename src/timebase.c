@@ -0,0 +1,156 @@
+#include "timebase.h"
+#include <timer.h>
+#include <timer0.h>
+#include <debug.h>
+
+/**
+ * Timer0 runs off the 16MHz system clock, divided by 10, and interrupts each time its ON counter runs down.
+ * The interrupt just advances a tick count: deadlines are a tick count to compare against, so there is no list
+ * to keep, and SysTick is left alone for whoever else wants it (e.g. SystemView's timestamps).
+ */
+#define TIMEBASE_TIMER_HZ 1600000
+#define TIMEBASE_RELOAD ((TIMEBASE_TIMER_HZ / 1000000) * TIMEBASE_TICK_US)
+
+// How long the delay loop is timed against the ticks for.  Long enough that the tick it starts part way
+// through doesn't matter much.
+#define TIMEBASE_CAL_TICKS 20
+
+static volatile uint32_t timebase_ticks;
+// Number of deadlines armed.  The timer runs while this is non-zero.
+static uint8_t timebase_users;
+// Iterations of timebase_spin() per microsecond, in 1/16ths.  Measured once at start up.
+static uint32_t timebase_loops_x16;
+
+
+static void timebase_tick_cb(void) {
+    timebase_ticks++;
+}
+
+static void timebase_hold() {
+    if (timebase_users++ == 0) {
+        timer0_start();
+    }
+}
+
+static void timebase_release() {
+    if (timebase_users && --timebase_users == 0) {
+        timer0_stop();
+    }
+}
+
+/**
+ * @brief The delay loop.  It is also what gets timed by the calibration, which is why it checks the ticks even
+ * when it's being used as a plain delay (with ticks set so that check never ends it).
+ *
+ * @return the number of iterations made.
+ */
+static __attribute__((noinline)) uint32_t timebase_spin(uint32_t loops, uint32_t start, uint32_t ticks) {
+    uint32_t n = 0;
+    while (n < loops && timebase_ticks - start < ticks) {
+        n++;
+    }
+    return n;
+}
+
+static void timebase_calibrate() {
+    timebase_hold();
+    // Line up with the start of a tick
+    uint32_t start = timebase_ticks;
+    while (timebase_ticks == start);
+    start = timebase_ticks;
+    uint32_t n = timebase_spin(UINT32_MAX, start, TIMEBASE_CAL_TICKS);
+    timebase_release();
+
+    timebase_loops_x16 = (n * 16) / (TIMEBASE_CAL_TICKS * TIMEBASE_TICK_US);
+    if (!timebase_loops_x16) {
+        timebase_loops_x16 = 1;
+    }
+    DEBUG_PRINT_STRING("Timebase loops/us x16: ");
+    DEBUG_PRINT_INT(timebase_loops_x16);
+    DEBUG_PRINT_STRING("\r\n");
+}
+
+/**
+ * @brief Sets Timer0 up as the timebase.  Must be called from periph_init(), as the timer loses its settings in
+ * sleep.  The delay loop is only calibrated the first time round.
+ */
+void timebase_init() {
+    set_tmr_enable(CLK_PER_REG_TMR_ENABLED);
+    set_tmr_div(CLK_PER_REG_TMR_DIV_1);
+    timer0_init(TIM0_CLK_FAST, PWM_MODE_ONE, TIM0_CLK_DIV_BY_10);
+    timer0_set(TIMEBASE_RELOAD, 1, 1);
+    timer0_register_callback(timebase_tick_cb);
+    timer0_enable_irq();
+
+    // Anything armed before we went to sleep is gone with the timer's state.
+    timebase_users = 0;
+    if (!timebase_loops_x16) {
+        timebase_calibrate();
+    }
+}
+
+/**
+ * @brief Arms a deadline us microseconds from now.  It is rounded up to whole ticks, counting the one already
+ * under way as nothing, so it never expires early.
+ */
+void timebase_deadline_start(timebase_deadline_t *deadline, uint32_t us) {
+    if (!deadline->armed) {
+        timebase_hold();
+        deadline->armed = true;
+    }
+    deadline->at = timebase_ticks + (us + TIMEBASE_TICK_US - 1) / TIMEBASE_TICK_US + 1;
+}
+
+/**
+ * @brief Disarms a deadline, letting the timer stop once nothing else is waiting.  Safe to call on one that
+ * was never armed.
+ */
+void timebase_deadline_end(timebase_deadline_t *deadline) {
+    if (deadline->armed) {
+        deadline->armed = false;
+        timebase_release();
+    }
+}
+
+bool timebase_expired(const timebase_deadline_t *deadline) {
+    return (int32_t) (timebase_ticks - deadline->at) >= 0;
+}
+
+/**
+ * @brief Sleeps until ready() says so, or the deadline passes, whichever comes first.
+ *
+ * Interrupts are masked around the check so that whatever ready() is waiting for (e.g. a UART byte) or the
+ * timer landing between the check and the WFI still wakes us up.  Anything else that fires (e.g. the BLE
+ * core) gets serviced on the way through.
+ *
+ * @param ready may be NULL, to just wait for the deadline.
+ * @return true if ready() came true, false if the deadline passed first.
+ */
+bool timebase_wait(const timebase_deadline_t *deadline, timebase_cond_t ready) {
+    while (!ready || !ready()) {
+        if (timebase_expired(deadline)) {
+            return false;
+        }
+        __disable_irq();
+        if ((!ready || !ready()) && !timebase_expired(deadline)) {
+            __WFI();
+        }
+        __enable_irq();
+    }
+    return true;
+}
+
+/**
+ * @brief Waits for us microseconds.  Short delays are spun out on the calibrated loop; longer ones sleep on a
+ * deadline, and so may run a tick or so over.
+ */
+void timebase_delay_us(uint32_t us) {
+    if (us < TIMEBASE_SPIN_MAX_US) {
+        timebase_spin((us * timebase_loops_x16) >> 4, timebase_ticks, UINT32_MAX);
+        return;
+    }
+    timebase_deadline_t deadline = { 0 };
+    timebase_deadline_start(&deadline, us);
+    timebase_wait(&deadline, NULL);
+    timebase_deadline_end(&deadline);
+}
@@ -1,10 +1,11 @@
 
 #include "updi.h"
 #include <uart.h>
-#include <app_easy_timer.h>
+#include <gpio.h>
 #include <debug.h>
 #include "user_app.h"
-#include <systick.h>
+#include "timebase.h"
+#include <string.h>
  
 
 #define UPDI_BREAK 0x00
@@ -64,6 +65,10 @@
 #define UPDI_ASI_CRC_STATUS 0x0C
 
 #define UPDI_CTRLA_IBDLY_BIT 7
+#define UPDI_CTRLA_RSD_BIT 3
+#define UPDI_CTRLA_GTVAL_MASK 0x07
+// GTVAL counts down the guard time: 0 = 128 cycles (the default), 1 = 64 ... 6 = 2 cycles.
+#define UPDI_CTRLA_GTVAL_MIN 6
 #define UPDI_CTRLB_CCDETDIS_BIT 3
 #define UPDI_CTRLB_UPDIDIS_BIT 2
 
@@ -74,76 +79,41 @@
 #define UPDI_ASI_KEY_STATUS_NVMPROG 4
 #define UPDI_ASI_KEY_STATUS_UROWWRITE 5
 
-#define UPDI_ASI_SYS_STATUS_RSTSYS 5
-#define UPDI_ASI_SYS_STATUS_INSLEEP 4
-#define UPDI_ASI_SYS_STATUS_NVMPROG 3
-#define UPDI_ASI_SYS_STATUS_UROWPROG 2
-#define UPDI_ASI_SYS_STATUS_LOCKSTATUS 0
-
 #define UPDI_ASI_SYS_CTRLA_UROW_FINAL 1
 
+// ASI_CTRLA UPDICLKSEL.  4MHz is the reset default.
+#define UPDI_ASI_CTRLA_CLKSEL_16M 0x01
+#define UPDI_ASI_CTRLA_CLKSEL_8M 0x02
+#define UPDI_ASI_CTRLA_CLKSEL_4M 0x03
+
+// Number of consecutive good LDCS probes a baud rate needs before we trust it
+#define UPDI_BAUD_PROBES 4
+
 #define UPDI_RESET_REQ_VALUE 0x59
 
-//FLASH CONTROLLER
-#define UPDI_NVMCTRL_CTRLA 0x00
-#define UPDI_NVMCTRL_CTRLB 0x01
-#define UPDI_NVMCTRL_STATUS 0x02
-#define UPDI_NVMCTRL_INTCTRL 0x03
-#define UPDI_NVMCTRL_INTFLAGS 0x04
-#define UPDI_NVMCTRL_DATAL 0x06
-#define UPDI_NVMCTRL_DATAH 0x07
-#define UPDI_NVMCTRL_ADDRL 0x08
-#define UPDI_NVMCTRL_ADDRH 0x09
-
-//NVMCTRL v0 CTRLA
-#define UPDI_V0_NVMCTRL_CTRLA_NOP 0x00
-#define UPDI_V0_NVMCTRL_CTRLA_WRITE_PAGE 0x01
-#define define UPDI_V0_NVMCTRL_CTRLA_ERASE_PAGE 0x02
-#define UPDI_V0_NVMCTRL_CTRLA_ERASE_WRITE_PAGE 0x03
-#define UPDI_V0_NVMCTRL_CTRLA_PAGE_BUFFER_CLR 0x04
-#define UPDI_V0_NVMCTRL_CTRLA_CHIP_ERASE 0x05
-#define UPDI_V0_NVMCTRL_CTRLA_ERASE_EEPROM 0x06
-#define UPDI_V0_NVMCTRL_CTRLA_WRITE_FUSE 0x07
-
-//NVMCTRL v2 CTRLA
-#define UPDI_V2_NVMCTRL_CTRLA_NOCMD 0x00
-#define UPDI_V2_NVMCTRL_CTRLA_FLASH_WRITE 0x02
-#define UPDI_V2_NVMCTRL_CTRLA_FLASH_PAGE_ERASE 0x08
-#define UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE_WRITE 0x13
-#define UPDI_V2_NVMCTRL_CTRLA_CHIP_ERASE 0x20
-#define UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE 0x30
-
-//NVMCTRL v3 CTRLA
-#define UPDI_V3_NVMCTRL_CTRLA_NOCMD 0x00
-#define UPDI_V3_NVMCTRL_CTRLA_NOP 0x01
-#define UPDI_V3_NVMCTRL_CTRLA_FLASH_PAGE_WRITE 0x04
-#define UPDI_V3_NVMCTRL_CTRLA_FLASH_PAGE_ERASE_WRITE 0x05
-#define UPDI_V3_NVMCTRL_CTRLA_FLASH_PAGE_ERASE 0x08
-#define UPDI_V3_NVMCTRL_CTRLA_FLASH_PAGE_BUFFER_CLEAR 0x0F
-#define UPDI_V3_NVMCTRL_CTRLA_EEPROM_PAGE_WRITE 0x14
-#define UPDI_V3_NVMCTRL_CTRLA_EEPROM_PAGE_ERASE_WRITE 0x15
-#define UPDI_V3_NVMCTRL_CTRLA_EEPROM_PAGE_ERASE 0x17
-#define UPDI_V3_NVMCTRL_CTRLA_EEPROM_PAGE_BUFFER_CLEAR 0x1F
-#define UPDI_V3_NVMCTRL_CTRLA_CHIP_ERASE 0x20
-#define UPDI_V3_NVMCTRL_CTRLA_EEPROM_ERASE 0x30
-
-
-
-
-#define UPDI_NVM_STATUS_WRITE_ERROR 2
-#define UPDI_NVM_STATUS_EEPROM_BUSY 1
-#define UPDI_NVM_STATUS_FLASH_BUSY 0
-
-#define USERDATA_SZ 32
-#define USERDATA_ADDR 0x1300
 #define KEY_SZ 8
 
 
-#define updi_send(x) uart_write_byte(UART2, x)
+/**
+ * Every instruction is built up whole (SYNC, opcode, address, and data where no ACK is needed in between) and
+ * handed to the UART in one uart_write_buffer(), rather than fed in a byte at a time.  Fixed frames are
+ * initialisers, so they cost no more than the bytes themselves.
+ */
+#define UPDI_FRAME_OP(op) { UPDI_PHY_SYNC, (op) }
+#define UPDI_FRAME_LDCS(reg) { UPDI_PHY_SYNC, UPDI_LDCS | (reg) }
+#define UPDI_FRAME_STCS(reg, val) { UPDI_PHY_SYNC, UPDI_STCS | (reg), (val) }
+// SYNC, opcode and up to a 24 bit address
+#define UPDI_FRAME_ADDRESS_MAX 5
+// SYNC, REPEAT and a 16 bit count
+#define UPDI_FRAME_REPEAT_MAX 4
 
+// Must be a power of two.  Comfortably holds the largest single transfer (the 32 byte SIB) plus slack.
+#define UPDI_RX_BUF_SZ 64
+
+// Overrun bit, as passed to the UART error callback (16550 LSR layout)
+#define UPDI_UART_LSR_OE 0x02
 
 
-static timer_hnd timer_handle = EASY_TIMER_INVALID_TIMER;
 
 /**
  * Key for unlocking NVM - Its NVMProg' ' backwards (lsb is sent first)
@@ -161,32 +131,7 @@ static const uint8_t UPDI_KEY_UROW[KEY_SZ] = {'e', 't', '&', 's', 'U', 'M', 'V',
 
 
 
-/**
- * data (Read/Writeable) - one for BLE - max 64 bytes long (one Attiny page)
- * operation (Writeable)- write to it to set off an operation - Has two bytes - an id and a command
- * address (Read/Writeable) - The Address/block to use.
- * result (Read/Notifiable) - The outcome of the operation - id and outcome. ID is synced to command.
- * 
- * Operations:
- *   - Read Device Info (possibly a different characteristic)
- *   - Read from Address into data - Can this be instant?  Also requires a length parameter.
- *   - Write from data to Address - Does different things depending on address. Will Erase first if address is flash
- *   - Normal Reset device 
- *   - Reset UPDI
- * 
- * Responses
- *   - In Progress
- *   - Success
- *   - Device not responsive
- *   - Invalid Address
- *   - Invalid Size
- *   - Write failed. 
- * 
- * All operations should copy data from buffer into internal buffer when operating to allow the client to
- * queue the next command. 
- * 
- * All writes to command will fail until previous command have completed.
- */
+// The operation / data / result protocol that drives all this over BLE is in ble_ops.h.
 
 
 // static void reset_complete() {
@@ -195,72 +140,291 @@ static const uint8_t UPDI_KEY_UROW[KEY_SZ] = {'e', 't', '&', 's', 'U', 'M', 'V',
 
 static uint8_t updi_rev;
 
+/**
+ * UART2 rates to try, slowest first.  The target autobauds off the SYNC character at the start of every
+ * instruction, so we only ever need to change our end.  At the default 4MHz UPDI clock the target tops out
+ * at around 225 kbit, so anything above 115200 needs the UPDI clock raised first.
+ */
+static const uint32_t updi_baud_rates[] = {
+    UART_BAUDRATE_115200,
+    UART_BAUDRATE_230400,
+    UART_BAUDRATE_460800,
+    UART_BAUDRATE_921600,
+};
+#define UPDI_BAUD_RATES_NB (sizeof(updi_baud_rates) / sizeof(updi_baud_rates[0]))
+// The same rates in bits per second, for working out how long a reply should take.
+static const uint32_t updi_baud_bps[UPDI_BAUD_RATES_NB] = {
+    115200,
+    230400,
+    460800,
+    921600,
+};
+
+// Start, 8 data, parity and 2 stop bits
+#define UPDI_FRAME_BITS 12
+// Allowance for the target turning the line around: the longest guard time is 128 UPDI clocks, which is 32us
+// at the default 4MHz, but it runs slower while the clock is being changed.
+#define UPDI_RX_TURNAROUND_US 200
+
+// Index into updi_baud_rates of the rate currently in use
+static uint8_t updi_baud_idx;
+// Highest index that has worked.  Lowered whenever a rate fails, so we don't keep retrying it.
+static uint8_t updi_baud_ceiling = UPDI_BAUD_RATES_NB - 1;
+
+/**
+ * What we last programmed into CS_CTRLA, so bits can be flipped temporarily and then restored.  This also holds
+ * the tuned guard time and inter-byte-delay for the session, which are re-applied after every break.
+ */
+static uint8_t updi_ctrla;
+
+static updi_link_stats_t updi_stats;
+// Largest GTVAL (i.e. shortest guard time) the link will put up with.  Lowered when a setting fails.
+static uint8_t updi_gtval_floor = UPDI_CTRLA_GTVAL_MIN;
+
+// Where the target's pointer is sitting during a streaming read
+static uint32_t updi_stream_ptr;
+
+/**
+ * Receive ring buffer, filled from the UART2 RX interrupt and drained by updi_read_byte() / updi_read_buffer().
+ * The ISR only ever moves the head and the readers only ever move the tail, so no locking is needed.
+ */
+static volatile uint8_t updi_rx_buf[UPDI_RX_BUF_SZ];
+static volatile uint8_t updi_rx_head;
+static volatile uint8_t updi_rx_tail;
+static volatile bool updi_rx_overrun;
+// Single byte landing zone for the SDK driver's interrupt mode receive.
+static uint8_t updi_rx_byte;
+
+
+static void updi_uart_err_cb(uart_t *uart, uint8_t uart_err_status) {
+    if (uart_err_status & UPDI_UART_LSR_OE) {
+        updi_rx_overrun = true;
+    }
+}
+
+static inline void updi_rx_push(uint8_t val) {
+    uint8_t next = (updi_rx_head + 1) & (UPDI_RX_BUF_SZ - 1);
+    if (next == updi_rx_tail) {
+        updi_rx_overrun = true;
+    } else {
+        updi_rx_buf[updi_rx_head] = val;
+        updi_rx_head = next;
+    }
+}
+
+static void updi_rx_cb(uint16_t length) {
+    if (length) {
+        updi_rx_push(updi_rx_byte);
+    }
+    // Empty the FIFO while we're here, rather than taking an interrupt per byte (one every ~12us at the top rate)
+    while (uart_data_ready_getf(UART2)) {
+        updi_rx_push(uart_read_byte(UART2));
+    }
+    uart_receive(UART2, &updi_rx_byte, 1, UART_OP_INTR);
+}
+
+static inline bool updi_rx_empty() {
+    return updi_rx_head == updi_rx_tail;
+}
+
+static inline uint8_t updi_rx_pop() {
+    uint8_t val = updi_rx_buf[updi_rx_tail];
+    updi_rx_tail = (updi_rx_tail + 1) & (UPDI_RX_BUF_SZ - 1);
+    return val;
+}
+
+/**
+ * @brief Discards anything left over in the receive buffer (e.g. a late reply to a transaction that timed out)
+ */
+static void updi_rx_flush() {
+    updi_rx_tail = updi_rx_head;
+    updi_rx_overrun = false;
+}
+
+/**
+ * @brief Turns the line around from transmit to receive, once the last byte has actually left the shift register.
+ */
+static void updi_line_rx() {
+    uart_wait_tx_finish(UART2);
+    updi_rx_flush();
+    uart_one_wire_rx_en(UART2);
+}
+
+static bool updi_rx_ready() {
+    return !updi_rx_empty();
+}
+
+/**
+ * @brief Sleeps until the receive buffer holds something, or the deadline has passed.
+ *
+ * @return true if data is available, false if the timeout expired first.
+ */
+static inline bool updi_rx_wait(const timebase_deadline_t *deadline) {
+    return timebase_wait(deadline, updi_rx_ready);
+}
 
-static void updi_send_sync() {
+/**
+ * @brief How long to allow for n bytes to come back at the current rate: twice their time on the wire, plus
+ * the target's turnaround.
+ */
+static uint32_t updi_rx_timeout(uint16_t n) {
+    return UPDI_RX_TURNAROUND_US + ((uint32_t) n * 2 * UPDI_FRAME_BITS * 1000) / (updi_baud_bps[updi_baud_idx] / 1000);
+}
+
+/**
+ * @brief Hooks the UPDI receive path up to the UART2 RX interrupt.  Must be called after the UART has been
+ * initialised (and again after every re-initialisation, as that clears the driver's callbacks).  A wake from
+ * extended sleep re-initialises the UART at the default rate, so the rate negotiated with the target is put back.
+ */
+void updi_init() {
+    uart_baudrate_setf(UART2, updi_baud_rates[updi_baud_idx]);
+    updi_rx_head = updi_rx_tail = 0;
+    updi_rx_overrun = false;
+    uart_register_rx_cb(UART2, updi_rx_cb);
+    uart_register_err_cb(UART2, updi_uart_err_cb);
+    uart_receive(UART2, &updi_rx_byte, 1, UART_OP_INTR);
+}
+
+
+static void updi_send_frame(const uint8_t *frame, uint16_t len) {
     uart_one_wire_tx_en(UART2);
-    updi_send(UPDI_PHY_SYNC);
+    uart_write_buffer(UART2, frame, len);
+}
+
+/**
+ * @brief Builds an LDS/STS/ST ptr frame, using the 24 bit address form only when it won't fit in 16 (e.g. flash
+ * on AVR Dx/Ex parts, which sits at 0x800000).
+ * 
+ * @param opcode the instruction, without its address size
+ * @param size_shift where the instruction wants the address size: 2 for LDS/STS, 0 for ST ptr
+ * @return the length of the frame
+ */
+static inline uint8_t updi_frame_address(uint8_t *frame, uint8_t opcode, uint8_t size_shift, uint32_t address) {
+    bool wide = address > 0xFFFF;
+    frame[0] = UPDI_PHY_SYNC;
+    frame[1] = opcode | ((wide ? UPDI_DATA_24 : UPDI_DATA_16) << size_shift);
+    frame[2] = address & 0xFF;
+    frame[3] = (address >> 8) & 0xFF;
+    if (wide) {
+        frame[4] = (address >> 16) & 0xFF;
+        return 5;
+    }
+    return 4;
+}
+
+/**
+ * @brief Builds a REPEAT frame for num transfers, in its word form if the count needs it.
+ * 
+ * @return the length of the frame
+ */
+static inline uint8_t updi_frame_repeat(uint8_t *frame, uint16_t num) {
+    num -= 1;
+    frame[0] = UPDI_PHY_SYNC;
+    if (num > 0xFF) {
+        frame[1] = UPDI_REPEAT | UPDI_REPEAT_WORD;
+        frame[2] = num & 0xFF;
+        frame[3] = num >> 8;
+        return 4;
+    }
+    frame[1] = UPDI_REPEAT | UPDI_REPEAT_BYTE;
+    frame[2] = num;
+    return 3;
 }
 
 static void updi_write_cs_reg(uint8_t reg, uint8_t val) {
-    updi_send_sync();
-    updi_send(UPDI_STCS | reg);
-    uart_write_byte(UART2, val);
+    const uint8_t frame[] = UPDI_FRAME_STCS(reg, val);
+    updi_send_frame(frame, sizeof(frame));
 }
 
 
 
+/**
+ * @brief Works out why a receive came up short.  If we dropped bytes on the floor (either the FIFO or the ring
+ * buffer overflowed) the target is asked to space its bytes out from now on, with CTRLA.IBDLY.
+ */
+static updi_err_t updi_rx_error() {
+    if (!updi_rx_overrun) {
+        return UPDIERR_TIMEOUT;
+    }
+    if (!(updi_ctrla & (1 << UPDI_CTRLA_IBDLY_BIT))) {
+        DEBUG_PRINT_STRING("UPDI RX overrun, enabling IBDLY\r\n");
+        updi_ctrla |= (1 << UPDI_CTRLA_IBDLY_BIT);
+        updi_write_cs_reg(UPDI_CS_CTRLA, updi_ctrla);
+    }
+    return UPDIERR_OVERRUN;
+}
+
 static updi_err_t updi_read_byte(uint8_t *data, uint32_t timeout) {
     // Wait until received data are available
     updi_err_t err = UPDI_OK;
-    systick_start(timeout, false);
-    while (!GetBits32(&SysTick->CTRL, SysTick_CTRL_COUNTFLAG_Msk)) {
-        if (uart_data_ready_getf(UART2)) {
-            // Read element from the receive FIFO
-            *data = uart_read_rbr(UART2);
-            goto cleanup;
-        }
+    timebase_deadline_t deadline = { 0 };
+    timebase_deadline_start(&deadline, timeout);
+    if (updi_rx_wait(&deadline)) {
+        *data = updi_rx_pop();
+    } else {
+        err = updi_rx_error();
     }
-    err = UPDIERR_TIMEOUT;
-cleanup:
-    systick_stop();
+    timebase_deadline_end(&deadline);
     return err;
 }
 
 static updi_err_t updi_read_cs_reg(uint8_t reg, uint8_t *out) {
-    updi_send_sync();
-    updi_send(UPDI_LDCS | reg);
-    uart_wait_tx_finish(UART2);
-
-    uart_one_wire_rx_en(UART2);
-    return updi_read_byte(out, 2000);
+    const uint8_t frame[] = UPDI_FRAME_LDCS(reg);
+    updi_send_frame(frame, sizeof(frame));
+    updi_line_rx();
+    return updi_read_byte(out, updi_rx_timeout(1));
 }
 
-updi_err_t updi_send_break() {
-    DEBUG_PRINT_STRING("Sending Break\r\n");
-
-    // Drive the output low for at least 24.6 millis (recommended by datasheet.).  do it twice
-    // We do this by setting the baud to 300 then sending 0x00 twice.
-    uart_baudrate_setf(UART2, 0x0D0505);
-    uart_one_wire_tx_en(UART2);
-    uart_write_byte(UART2, 0x00);
-    uart_write_byte(UART2, 0x00);
-
-    // Reset the bad back to normal.
-    uart_baudrate_setf(UART2, UART_BAUDRATE_115200);
+/**
+ * @brief Sets the link up at the default rate, as the target's UPDI is left after a break.
+ */
+static updi_err_t updi_after_break() {
+    // Reset the baud back to normal.
+    updi_baud_idx = 0;
+    uart_baudrate_setf(UART2, updi_baud_rates[updi_baud_idx]);
 
-   
     // Disable Collision Detection
     updi_write_cs_reg(UPDI_CS_CTRLB, (1<<UPDI_CTRLB_CCDETDIS_BIT));
 
-    // Turn on inter-byte-delay
-    updi_write_cs_reg(UPDI_CS_CTRLA, (1<<UPDI_CTRLA_IBDLY_BIT));
-
+    // Guard time and inter-byte-delay, as tuned for this session
+    updi_write_cs_reg(UPDI_CS_CTRLA, updi_ctrla);
 
     // Get status
     return updi_read_cs_reg(UPDI_CS_STATUSA, &updi_rev);
 }
 
+/**
+ * Breaks, for the session and for recovery alike.  The pad is taken off the UART and driven low as a GPIO, and
+ * the caller comes back (off a timer) once UPDI_BREAK_MS has passed, rather than us spinning while a 300 baud
+ * character goes out:
+ * 
+ *   updi_break_hold()     - line low
+ *   updi_break_release()  - line high, between the two halves of a double break
+ *   updi_break_done()     - pad back to the UART, and the link set up at the default rate
+ * 
+ * A wake from extended sleep puts the pad back on the UART, so the caller has to keep the system awake for the
+ * hold.  The op engine does, for as long as it has ops queued.
+ */
+void updi_break_hold() {
+    DEBUG_PRINT_STRING("Holding Break\r\n");
+    uart_wait_tx_finish(UART2);
+    GPIO_ConfigurePin(UPDI_PORT, UPDI_PIN, OUTPUT, PID_GPIO, false);
+    updi_stats.breaks++;
+}
+
+void updi_break_release() {
+    GPIO_SetActive(UPDI_PORT, UPDI_PIN);
+}
 
+updi_err_t updi_break_done() {
+    GPIO_ConfigurePin(UPDI_PORT, UPDI_PIN, OUTPUT, PID_UART2_TX, false);
+    return updi_after_break();
+}
+
+
+/**
+ * @brief A single STATUSA read, to see whether the target is answering.
+ */
 bool updi_check_link() {
     uint8_t val;
     updi_err_t err = updi_read_cs_reg(UPDI_CS_STATUSA, &val);
@@ -272,155 +436,274 @@ bool updi_check_link() {
 
 
 /**
- * @briefChecks whether the NVM PROG flag is up
- * 
- * @return true if the flag is set
- * @return false otherwise
+ * @brief Checks that the link is solid at the current baud rate, with a few back-to-back STATUSA probes.
  */
-static bool updi_in_programming_mode() {
-    uint8_t val;
-    updi_err_t err = updi_read_cs_reg(UPDI_ASI_SYS_STATUS, &val);
-    if (err) {
-        return false;
+static bool updi_probe_link() {
+    for (int i = 0; i < UPDI_BAUD_PROBES; i++) {
+        uint8_t val;
+        if (updi_read_cs_reg(UPDI_CS_STATUSA, &val) || val != updi_rev) {
+            return false;
+        }
     }
-    return val & (1 << UPDI_ASI_SYS_STATUS_NVMPROG);
+    return true;
 }
 
-static bool updi_is_locked() {
-    uint8_t val;
-    updi_err_t err = updi_read_cs_reg(UPDI_ASI_SYS_STATUS, &val);
-    if (err) {
-        return true; // I suppose?
+/**
+ * @brief Raises the target's UPDI clock from the default 4MHz to 16MHz, which lifts its maximum baud rate.  Should
+ * be called straight after a break.
+ * 
+ * @return updi_err_t UPDIERR_MODE_CHANGE_FAILED if the target stopped responding.  It then takes a break to get
+ * it back to the default clock, and the link stays at the default rate from then on.
+ */
+updi_err_t updi_raise_clock() {
+    updi_write_cs_reg(UPDI_ASI_CTRLA, UPDI_ASI_CTRLA_CLKSEL_16M);
+    if (updi_probe_link()) {
+        return UPDI_OK;
     }
-    return val & (1 << UPDI_ASI_SYS_STATUS_LOCKSTATUS);
+    // Some parts won't run UPDI at 16MHz at low supply voltages.
+    updi_baud_ceiling = 0;
+    return UPDIERR_MODE_CHANGE_FAILED;
 }
 
-static updi_err_t updi_wait_for_unlocked(uint32_t timeout) {
-    updi_err_t err = UPDI_OK;
-    systick_start(timeout, false);
-    while (!GetBits32(&SysTick->CTRL, SysTick_CTRL_COUNTFLAG_Msk)) {
-        if (!updi_is_locked()) {
-            goto cleanup;
-        }
+/**
+ * @brief Moves UART2 up to the next baud rate and verifies it.  If the new rate doesn't hold up, it falls back to
+ * the last good rate and lowers the ceiling so that rate isn't tried again.  Call repeatedly until it returns false.
+ * 
+ * The target picks the rate up from the SYNC at the start of each instruction, so falling back is only a matter of
+ * changing our end.  If the target has got itself stuck on the way, the next transaction fails, and it's up to the
+ * caller to break it out (as the op engine does after updi_resync()).
+ * 
+ * @return true if we moved up a rate, false if we are already as fast as the link will go.
+ */
+bool updi_step_baud_up() {
+    if (updi_baud_idx >= updi_baud_ceiling) {
+        return false;
     }
-    err = UPDIERR_TIMEOUT;
-cleanup:
-    systick_stop();
-    return err;
+
+    uint8_t good = updi_baud_idx;
+    updi_baud_idx++;
+    uart_baudrate_setf(UART2, updi_baud_rates[updi_baud_idx]);
+    if (updi_probe_link()) {
+        DEBUG_PRINT_STRING("UPDI baud step ");
+        DEBUG_PRINT_INT(updi_baud_idx);
+        DEBUG_PRINT_STRING("\r\n");
+        return true;
+    }
+
+    updi_baud_ceiling = good;
+    updi_baud_idx = good;
+    uart_baudrate_setf(UART2, updi_baud_rates[updi_baud_idx]);
+    return false;
 }
 
 /**
- * @brief Resets the device by toggling the reset register.
+ * @brief Shortens the guard time the target waits before replying by one notch, and verifies it.  If replies
+ * start going missing (because they arrive before we have turned the line around) it goes back to the last good
+ * setting and stops there.  Call repeatedly until it returns false.  As with updi_step_baud_up(), a target left
+ * stuck by the failed setting is the caller's to break out.
  * 
+ * @return true if the guard time was shortened, false if it is as short as the link allows.
  */
-void updi_reset_device() {
-    updi_write_cs_reg(UPDI_ASI_RESET_REQ, UPDI_RESET_REQ_VALUE);
-    updi_write_cs_reg(UPDI_ASI_RESET_REQ, 0x00);
-}
+bool updi_step_guard_down() {
+    uint8_t gtval = updi_ctrla & UPDI_CTRLA_GTVAL_MASK;
+    if (gtval >= updi_gtval_floor) {
+        return false;
+    }
 
-static void updi_send_key(const uint8_t key[KEY_SZ]) {
-    updi_send_sync();
-    updi_send(UPDI_KEY | UPDI_SIB_8BYTES);
-    for (int i = 0; i < KEY_SZ; i++) {
-        updi_send(key[i]);
+    uint8_t good = updi_ctrla;
+    updi_ctrla = (good & ~UPDI_CTRLA_GTVAL_MASK) | (gtval + 1);
+    updi_write_cs_reg(UPDI_CS_CTRLA, updi_ctrla);
+    if (updi_probe_link()) {
+        return true;
     }
-    uart_one_wire_rx_en(UART2);
+
+    updi_gtval_floor = gtval;
+    updi_ctrla = good;
+    // STCS needs no reply, so this normally gets through.
+    updi_write_cs_reg(UPDI_CS_CTRLA, updi_ctrla);
+    return false;
 }
 
+/**
+ * @brief Forgets everything learned about the link (baud, guard time, inter-byte delay), ready for a new session.
+ */
+void updi_link_defaults() {
+    updi_baud_ceiling = UPDI_BAUD_RATES_NB - 1;
+    updi_gtval_floor = UPDI_CTRLA_GTVAL_MIN;
+    updi_ctrla = 0;
+}
 
 /**
- * @brief Erases chip, and unlocks if it was previously locked.
+ * @brief Gets the link going again after a transaction failed with cause, the cheap way: the target may be fine,
+ * and just missed (or we missed) a byte, so CTRLB/CTRLA are re-applied and the link checked.
  * 
+ * If that doesn't take, the target is most likely stuck part way through an instruction, waiting for bytes that
+ * got lost.  That takes a break (or if one doesn't do it, a double break) and the link brought back up to the
+ * rate it was at, which the op engine runs as steps of its own (see updi_break_hold()), and reports back through
+ * updi_resync_finished().
+ * 
+ * Keys, programming mode and the target itself are unaffected by any of these, so the caller can carry on
+ * from the transaction that failed.
+ * 
+ * @return updi_err_t UPDI_OK if the link is back, UPDIERR_TIMEOUT if it needs a break.
  */
-updi_err_t updi_erase_chip() {
-    updi_send_key(UPDI_KEY_CHIPERASE);
-    uint8_t key_status;
-    updi_err_t err = updi_read_cs_reg(UPDI_ASI_KEY_STATUS, &key_status);
-
-    if (err) {
-        return err;
+updi_err_t updi_resync(updi_err_t cause) {
+    switch (cause) {
+        case UPDIERR_TIMEOUT:
+            updi_stats.timeouts++;
+            break;
+        case UPDIERR_NACK:
+            updi_stats.nacks++;
+            break;
+        case UPDIERR_OVERRUN:
+            updi_stats.overruns++;
+            break;
+        default:
+            break;
     }
 
-    if ((key_status & (1 << UPDI_ASI_KEY_STATUS_CHIPERASE)) == 0) {
-        return UPDIERR_MODE_CHANGE_FAILED;
+    updi_write_cs_reg(UPDI_CS_CTRLB, (1 << UPDI_CTRLB_CCDETDIS_BIT));
+    updi_write_cs_reg(UPDI_CS_CTRLA, updi_ctrla);
+    if (updi_check_link()) {
+        updi_stats.resyncs++;
+        return UPDI_OK;
     }
+    return UPDIERR_TIMEOUT;
+}
 
-    updi_reset_device();
-    return updi_wait_for_unlocked(50);   
+/**
+ * @brief Counts the outcome of a resync that went as far as a break.
+ */
+void updi_resync_finished(bool ok) {
+    if (ok) {
+        updi_stats.resyncs++;
+    } else {
+        updi_stats.resync_failures++;
+    }
 }
 
+/**
+ * @brief Index into the baud rate table of the rate the link is at.
+ */
+uint8_t updi_baud_index() {
+    return updi_baud_idx;
+}
 
+/**
+ * @brief Counts of link faults and recoveries since boot.
+ */
+const updi_link_stats_t *updi_link_stats() {
+    return &updi_stats;
+}
 
-updi_err_t updi_enter_programming_mode() {
-    if (updi_in_programming_mode()) {
-        return UPDI_OK; // Already in programming mode.
+/**
+ * @brief Called after the link has been lost at a raised baud rate.  Drops down one rate for good.
+ * 
+ * @return the baud rate index to bring the link back up at, after a break.
+ */
+uint8_t updi_baud_fallback() {
+    if (updi_baud_idx == 0) {
+        return 0;
     }
+    updi_baud_ceiling = updi_baud_idx - 1;
+    return updi_baud_ceiling;
+}
 
-    updi_send_key(UPDI_KEY_NVM);
-    uint8_t key_status;
-    updi_err_t err = updi_read_cs_reg(UPDI_ASI_KEY_STATUS, &key_status);
 
-    if (err) {
-        return err;
+/**
+ * @brief Resets the device by toggling the reset register.
+ * 
+ */
+void updi_reset_device() {
+    updi_write_cs_reg(UPDI_ASI_RESET_REQ, UPDI_RESET_REQ_VALUE);
+    updi_write_cs_reg(UPDI_ASI_RESET_REQ, 0x00);
+}
+
+static void updi_send_key(const uint8_t key[KEY_SZ]) {
+    uint8_t frame[2 + KEY_SZ] = UPDI_FRAME_OP(UPDI_KEY | UPDI_SIB_8BYTES);
+    for (int i = 0; i < KEY_SZ; i++) {
+        frame[2 + i] = key[i];
     }
-    if ((key_status & (1 << UPDI_ASI_KEY_STATUS_NVMPROG)) == 0) {
-        return UPDIERR_MODE_CHANGE_FAILED;
+    updi_send_frame(frame, sizeof(frame));
+    updi_line_rx();
+}
+
+
+/**
+ * @brief Sends one of the activation keys, and checks that the target has accepted it.
+ * 
+ * @param key which key to send
+ * @return updi_err_t UPDIERR_MODE_CHANGE_FAILED if the key status bit didn't come up.
+ */
+updi_err_t updi_apply_key(updi_key_t key) {
+    const uint8_t *key_bytes;
+    uint8_t status_bit;
+
+    switch (key) {
+        case UPDI_KEYTYPE_CHIPERASE:
+            key_bytes = UPDI_KEY_CHIPERASE;
+            status_bit = UPDI_ASI_KEY_STATUS_CHIPERASE;
+            break;
+        case UPDI_KEYTYPE_UROW:
+            key_bytes = UPDI_KEY_UROW;
+            status_bit = UPDI_ASI_KEY_STATUS_UROWWRITE;
+            break;
+        case UPDI_KEYTYPE_NVM:
+        default:
+            key_bytes = UPDI_KEY_NVM;
+            status_bit = UPDI_ASI_KEY_STATUS_NVMPROG;
+            break;
     }
 
-    updi_reset_device();
-    err = updi_wait_for_unlocked(10);
+    updi_send_key(key_bytes);
+    uint8_t key_status;
+    updi_err_t err = updi_read_cs_reg(UPDI_ASI_KEY_STATUS, &key_status);
     if (err) {
         return err;
     }
-
-    if (!updi_in_programming_mode()) {
-        // Didn't work.
+    if ((key_status & (1 << status_bit)) == 0) {
+        return UPDIERR_MODE_CHANGE_FAILED;
     }
-    uart_one_wire_rx_en(UART2);
     return UPDI_OK;
 }
 
-void updi_leave_programming_mode() {
-    updi_reset_device();
-    updi_write_cs_reg(UPDI_CS_CTRLB, (1 << UPDI_CTRLB_UPDIDIS_BIT) | (1 << UPDI_CTRLB_CCDETDIS_BIT));
+/**
+ * @brief Reads the ASI_SYS_STATUS register (see UPDI_ASI_SYS_STATUS_* for the bits)
+ */
+updi_err_t updi_read_sys_status(uint8_t *status) {
+    return updi_read_cs_reg(UPDI_ASI_SYS_STATUS, status);
 }
 
-static updi_err_t updi_wait_for_user_row_writeable(uint32_t timeout, bool wait_for_high) {
-    bool timer_expired = false;
-    uint8_t status;
-    updi_err_t err = UPDI_OK;
-    systick_start(timeout, false);
-    while (!GetBits32(&SysTick->CTRL, SysTick_CTRL_COUNTFLAG_Msk)) {
-        err = updi_read_cs_reg(UPDI_ASI_SYS_STATUS, &status);
-        if (err || status & (1 << UPDI_ASI_SYS_STATUS_UROWPROG)) {
-            goto cleanup; // Worked!
-        }
+/**
+ * @brief Reads the result of the target's CRCSCAN, one of UPDI_ASI_CRC_STATUS_*.  Being a CS register this is
+ * a two byte LDCS on the wire, which makes it the cheapest thing to poll while a scan runs.
+ */
+updi_err_t updi_read_crc_status(uint8_t *status) {
+    uint8_t value;
+    updi_err_t err = updi_read_cs_reg(UPDI_ASI_CRC_STATUS, &value);
+    if (err) {
+        return err;
     }
-    err = UPDIERR_TIMEOUT;
-cleanup:
-    systick_stop();
-    return err;
+    *status = value & UPDI_ASI_CRC_STATUS_MASK;
+    return UPDI_OK;
 }
 
 
-
-static updi_err_t updi_read_buffer(uint8_t *data, uint8_t sz, uint32_t timeout) {
+static updi_err_t updi_read_buffer(uint8_t *data, uint16_t sz, uint32_t timeout) {
     // Wait until received data are available
     updi_err_t err = UPDI_OK;
-    systick_start(timeout, false);
+    timebase_deadline_t deadline = { 0 };
+    timebase_deadline_start(&deadline, timeout);
 
     while (sz--) {     
-        while (!uart_data_ready_getf(UART2)) {
-            if (GetBits32(&SysTick->CTRL, SysTick_CTRL_COUNTFLAG_Msk)) {
-                err = UPDIERR_TIMEOUT;
-                goto cleanup;
-            }
+        if (!updi_rx_wait(&deadline)) {
+            err = updi_rx_error();
+            goto cleanup;
         }
-        // Read element from the receive FIFO
-        *data++ = uart_read_rbr(UART2);
+        *data++ = updi_rx_pop();
     }
 cleanup:
-    systick_stop();
+    timebase_deadline_end(&deadline);
     return err;
 }
 
@@ -428,9 +711,9 @@ cleanup:
 static updi_err_t updi_wait_for_ack() {
     uint8_t response;
 
-    uart_one_wire_rx_en(UART2);
-    // Response should come after about 1 ms, so we give it 2.
-    updi_err_t err = updi_read_byte(&response, 2000);
+    updi_line_rx();
+    // The ACK comes back after the guard time, like any other response.
+    updi_err_t err = updi_read_byte(&response, updi_rx_timeout(1));
     if (!err) {
         if (response != UPDI_PHY_ACK) {
             return UPDIERR_NACK;
@@ -453,92 +736,124 @@ updi_err_t updi_st_data_phase(uint8_t *values, size_t sz) {
     if (err) {
         return err;
     }
-    uart_one_wire_tx_en(UART2);
-    uart_write_buffer(UART2, values, sz);
+    updi_send_frame(values, sz);
     err = updi_wait_for_ack();
     return err;
 }
 
 
-updi_err_t updi_st(uint16_t address, uint8_t data) {
-    updi_send_sync();
-    updi_send(UPDI_STS | UPDI_ADDRESS_16 | UPDI_DATA_8);
-    updi_send(address & 0xFF);
-    updi_send(address >> 8);
+updi_err_t updi_st(uint32_t address, uint8_t data) {
+    uint8_t frame[UPDI_FRAME_ADDRESS_MAX];
+    updi_send_frame(frame, updi_frame_address(frame, UPDI_STS | UPDI_DATA_8, 2, address));
     return updi_st_data_phase(&data, 1);
 }
 
+/**
+ * @brief Loads a single byte directly (LDS).  Cheaper than setting the pointer for one-off register reads.
+ */
+updi_err_t updi_ld(uint32_t address, uint8_t *out) {
+    uint8_t frame[UPDI_FRAME_ADDRESS_MAX];
+    updi_send_frame(frame, updi_frame_address(frame, UPDI_LDS | UPDI_DATA_8, 2, address));
+    updi_line_rx();
+    return updi_read_byte(out, updi_rx_timeout(1));
+}
+
 /**
  * @brief  Set the pointer location
  * 
  * @param address address to write
  * @return updi_err_t 
  */
-updi_err_t updi_st_ptr(uint16_t address) {
-    updi_send_sync();
-    updi_send(UPDI_ST | UPDI_PTR_ADDRESS | UPDI_DATA_16);
-    updi_send(address & 0xFF);
-    updi_send(address >> 8);
+updi_err_t updi_st_ptr(uint32_t address) {
+    uint8_t frame[UPDI_FRAME_ADDRESS_MAX];
+    updi_send_frame(frame, updi_frame_address(frame, UPDI_ST | UPDI_PTR_ADDRESS, 0, address));
     return updi_wait_for_ack();
 }
 
 /**
- * @brief Store a value to the repeat counter
- * 
- * @param num number of repeats requested
- * @return updi_err_t 
+ * @brief Whether a block can be moved a word at a time.  Halves the number of instructions the target has to
+ * execute, and for writes without RSD, the number of ACKs.
  */
-void updi_repeat(uint8_t num) {
-    num -= 1;
-    updi_send_sync();
-    updi_send(UPDI_REPEAT | UPDI_REPEAT_BYTE);
-    updi_send(num);
+static inline bool updi_use_words(uint32_t address, uint16_t sz) {
+    return (address & 1) == 0 && (sz & 1) == 0 && sz >= 4;
 }
 
 /**
- * @brief Writes out bytes after the address has been set.  Expects Ack after each byte.
+ * @brief Writes out data after the address has been set, as a single burst.
+ * 
+ * Response signatures are disabled (CTRLA.RSD) for the duration of the block, so rather than turning the line
+ * around to wait for an ACK after every byte, the whole REPEAT block goes out in one uart_write_buffer().  As
+ * there is no per-byte ACK to catch a dropped byte, the link is probed once at the end to make sure the target
+ * is still in step with us.
+ * 
+ * None of the instructions ahead of the data (RSD on, REPEAT, ST ptr++) get a reply, so they go out as one
+ * frame.
  * 
  * @param data data to store
+ * @param sz number of bytes
+ * @param width UPDI_DATA_8 or UPDI_DATA_16
  * @return updi_err_t 
  */
-static updi_err_t updi_st_ptr_inc(uint8_t *data, uint8_t sz) {
-    updi_err_t err;
-    updi_send_sync();
-    updi_send(UPDI_ST | UPDI_PTR_INC |  UPDI_DATA_8);
-
-
-    while (sz--) {
-        uart_one_wire_tx_en(UART2);
-        updi_send(*data++);
-        err = updi_wait_for_ack(); 
-        if (err) {
-            return err;
-        }
+static updi_err_t updi_st_ptr_inc(uint8_t *data, uint16_t sz, uint8_t width) {
+    const uint8_t rsd[] = UPDI_FRAME_STCS(UPDI_CS_CTRLA, updi_ctrla | (1 << UPDI_CTRLA_RSD_BIT));
+    const uint8_t st[] = UPDI_FRAME_OP(UPDI_ST | UPDI_PTR_INC | width);
+    uint8_t frame[sizeof(rsd) + UPDI_FRAME_REPEAT_MAX + sizeof(st)];
+    uint8_t len = 0;
+
+    memcpy(frame, rsd, sizeof(rsd));
+    len += sizeof(rsd);
+    len += updi_frame_repeat(&frame[len], width == UPDI_DATA_16 ? sz / 2 : sz);
+    memcpy(&frame[len], st, sizeof(st));
+    len += sizeof(st);
+
+    updi_send_frame(frame, len);
+    uart_write_buffer(UART2, data, sz);
+
+    // Responses back on.
+    updi_write_cs_reg(UPDI_CS_CTRLA, updi_ctrla);
+
+    if (!updi_check_link()) {
+        // Out of step, most likely from a byte lost on the wire.  A link fault rather than an NVM one.
+        return UPDIERR_TIMEOUT;
     }
     return UPDI_OK;
 }
 /**
  * @brief Loads a number of bytes from the pointer location with pointer post-increment
  * 
+ * The REPEAT (if more than one transfer is needed) and the LD go out as one frame.
+ * 
  * @param data the buffer to read into
  * @param size number of bytes to load
+ * @param width UPDI_DATA_8 or UPDI_DATA_16
  * @return updi_err_t 
  */
-static updi_err_t updi_ld_ptr_inc(uint8_t *data, uint8_t size) {
-    updi_send_sync();
-    updi_send(UPDI_LD | UPDI_PTR_INC |  UPDI_DATA_8);
-    uart_one_wire_rx_en(UART2);
+static updi_err_t updi_ld_ptr_inc(uint8_t *data, uint16_t size, uint8_t width) {
+    const uint8_t ld[] = UPDI_FRAME_OP(UPDI_LD | UPDI_PTR_INC | width);
+    uint8_t frame[UPDI_FRAME_REPEAT_MAX + sizeof(ld)];
+    uint8_t len = 0;
+    uint16_t num = width == UPDI_DATA_16 ? size / 2 : size;
+
+    if (num > 1) {
+        len += updi_frame_repeat(frame, num);
+    }
+    memcpy(&frame[len], ld, sizeof(ld));
+    len += sizeof(ld);
 
-    return updi_read_buffer(data, size, size * 1500);
+    updi_send_frame(frame, len);
+    updi_line_rx();
+
+    return updi_read_buffer(data, size, updi_rx_timeout(size));
 }
 
 /**
- * @brief Writes a number of bytes to memory on the target device.
+ * @brief Writes a number of bytes to memory on the target device.  Even sized blocks at even addresses are
+ * written a word at a time.
  * @param address address to write to
  * @param data data to write
  * @param sz size of data buffer
  */
-static updi_err_t updi_write_data(uint16_t address, const uint8_t *data, const uint8_t sz) {
+updi_err_t updi_write_data(uint32_t address, const uint8_t *data, uint16_t sz) {
     // Special case of 1 byte
     updi_err_t err;
 
@@ -554,28 +869,33 @@ static updi_err_t updi_write_data(uint16_t address, const uint8_t *data, const u
         return updi_st(address + 1, data[1]);
     }
 
+    bool words = updi_use_words(address, sz);
+    if (sz > (words ? 2 * UPDI_MAX_REPEAT_SIZE : UPDI_MAX_REPEAT_SIZE)) {
+        return UPDIERR_INVALID_SIZE;
+    }
+
     // Store the address
     err = updi_st_ptr(address);
     if (err) {
         return err;
     }
 
-    // Fire up the repeat
-    updi_repeat(sz);
-    return updi_st_ptr_inc((uint8_t *) data, (uint8_t) sz);
+    // Repeat and stream the lot
+    return updi_st_ptr_inc((uint8_t *) data, sz, words ? UPDI_DATA_16 : UPDI_DATA_8);
 }
 
 
 /**
- * @brief Reads a number of bytes of data from UPDI
+ * @brief Reads a number of bytes of data from UPDI.  Even sized blocks at even addresses are read a word at a time.
  * 
  * @param address address to write to
  * @param out 
  * @param size number of bytes to read
  * @return updi_err_t 
  */
-updi_err_t updi_read_data(uint16_t address, uint8_t *out, uint8_t size) {
-    if (size > UPDI_MAX_REPEAT_SIZE) {
+updi_err_t updi_read_data(uint32_t address, uint8_t *out, uint16_t size) {
+    bool words = updi_use_words(address, size);
+    if (size == 0 || size > (words ? 2 * UPDI_MAX_REPEAT_SIZE : UPDI_MAX_REPEAT_SIZE)) {
         return UPDIERR_INVALID_SIZE;
     }
 
@@ -585,75 +905,64 @@ updi_err_t updi_read_data(uint16_t address, uint8_t *out, uint8_t size) {
         return err;
     }
 
-    // Fire up the repeat
-    if (size > 1) {
-        updi_repeat(size);
-    }
-
-    
-
-    // Do the read(s)
-    return updi_ld_ptr_inc(out, size);
+    // Repeat, and do the read(s)
+    return updi_ld_ptr_inc(out, size, words ? UPDI_DATA_16 : UPDI_DATA_8);
 }
 
 
-updi_err_t updi_read_user_row(uint8_t data[USERDATA_SZ]) {
-    updi_err_t err;
-
-    if (!updi_in_programming_mode()) {
-        updi_enter_programming_mode();
-    }
-    usDelay(1000); // give it a moment...
-    return updi_read_data(USERDATA_ADDR, data, USERDATA_SZ);
+/**
+ * @brief Starts a streaming read at address.  Follow up with as many updi_read_stream() calls as needed.
+ */
+updi_err_t updi_start_stream(uint32_t address) {
+    updi_stream_ptr = address;
+    return updi_st_ptr(address);
 }
 
-updi_err_t updi_write_user_row(const uint8_t data[USERDATA_SZ]) {
-    updi_send_key(UPDI_KEY_UROW);
-    uint8_t key_status;
-    updi_err_t err = updi_read_cs_reg(UPDI_ASI_KEY_STATUS, &key_status);
-    if (err) {
-        return err;
-    }
-
-    if ((key_status & (1 << UPDI_ASI_KEY_STATUS_UROWWRITE)) == 0) {
-        // Didn't take it.
-        return UPDIERR_MODE_CHANGE_FAILED;
+/**
+ * @brief Reads the next window of a stream started by updi_start_stream().  Each window is just a REPEAT and an
+ * LD ptr++, as the pointer is already sitting where the last window finished.
+ * 
+ * @param out buffer to read into
+ * @param size window size in bytes, up to UPDI_MAX_REPEAT_SIZE.  Words are used if the stream (and window) is even.
+ * @return updi_err_t 
+ */
+updi_err_t updi_read_stream(uint8_t *out, uint16_t size) {
+    bool words = updi_use_words(updi_stream_ptr, size);
+    if (size == 0 || size > UPDI_MAX_REPEAT_SIZE) {
+        return UPDIERR_INVALID_SIZE;
     }
+    updi_stream_ptr += size;
 
-    updi_reset_device();
-    err = updi_wait_for_user_row_writeable(50, true);
-    if (err) {
-        return err;
-    }
+    return updi_ld_ptr_inc(out, size, words ? UPDI_DATA_16 : UPDI_DATA_8);
+}
 
-    // Write to buffer in ram (32 bytes)
-    updi_write_data(USERDATA_ADDR, data, USERDATA_SZ);
 
-    // Finalize the write
+/**
+ * @brief Commits the user row data written since the UROWWRITE key was applied.  Poll for
+ * UPDI_ASI_SYS_STATUS_UROWPROG to drop before calling updi_user_row_release()
+ */
+void updi_user_row_finalize() {
     updi_write_cs_reg(UPDI_ASI_SYS_CTRLA, (1 << UPDI_ASI_SYS_CTRLA_UROW_FINAL) | (1 << UPDI_CTRLB_CCDETDIS_BIT));
+}
 
-    err = updi_wait_for_user_row_writeable(50, false);
-    if (err) {
-        return err;
-    }
-
-    // Clear status
+/**
+ * @brief Clears the UROWWRITE key status and resets the target, ending the user row write.
+ */
+void updi_user_row_release() {
     updi_write_cs_reg(UPDI_ASI_KEY_STATUS, (1 << UPDI_ASI_KEY_STATUS_UROWWRITE) | (1 << UPDI_CTRLB_CCDETDIS_BIT));
     updi_reset_device();
-
-    return UPDI_OK;
 }
 
 
 updi_err_t updi_get_sib(updi_sib_t *sib) {
     // Doco says you read 16 bytes, not 32, but it appears as if you need to ask for 32
-    updi_send_sync();
-    updi_send(UPDI_KEY | UPDI_KEY_SIB | UPDI_SIB_32BYTES);
+    const uint8_t frame[] = UPDI_FRAME_OP(UPDI_KEY | UPDI_KEY_SIB | UPDI_SIB_32BYTES);
+    updi_send_frame(frame, sizeof(frame));
 
-    // Guard cycles defaults to 128
-    uart_one_wire_rx_en(UART2);
+    // Guard time is whatever was tuned for the session (128 cycles by default)
+    updi_line_rx();
     // Read in 16 bytes
-    return updi_read_buffer((uint8_t *) sib, 32, 32 * 1500);
+    return updi_read_buffer((uint8_t *) sib, 32, updi_rx_timeout(32));
 }
 
 
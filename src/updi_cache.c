@@ -0,0 +1,267 @@
+#include "updi_cache.h"
+#include "updi_device.h"
+#include <compiler.h>
+#include <app_easy_timer.h>
+#include <debug.h>
+#include <string.h>
+
+/**
+ * Shadow copy of the target's user row, so config reads can be answered without touching the target.
+ *
+ * The engine reports every finished op here, which is what keeps the copy honest: a successful read or write
+ * of the row refreshes it, and anything that might leave the row different from the copy (a failed write, a
+ * reset, a new session) drops it.  It lives in retention RAM so it survives the system sleeping between
+ * connection events.
+ *
+ * Writes to the row go through here too.  They are merged into a pending copy and only written to the target
+ * on an explicit flush, after UPDI_CACHE_IDLE_TICKS without another write, or on disconnect, so a client
+ * changing several fields costs one user row write (and its resets) rather than one per field.  A flush that
+ * wouldn't change anything writes nothing.
+ */
+
+// Quiet period (in 10ms ticks) after the last write before the pending row is flushed.
+#define UPDI_CACHE_IDLE_TICKS 200
+
+typedef struct {
+    uint8_t data[UPDI_MAX_USER_ROW_SZ];
+    uint16_t length;
+    bool valid;
+} updi_cache_entry_t;
+
+static updi_cache_entry_t updi_cache_urow __SECTION_ZERO("retention_mem_area0");
+
+// Bytes written but not yet flushed, marked in updi_cache_dirty (bit n for byte n).
+static uint8_t updi_cache_pending[UPDI_MAX_USER_ROW_SZ] __SECTION_ZERO("retention_mem_area0");
+static uint64_t updi_cache_dirty __SECTION_ZERO("retention_mem_area0");
+// What is being written, which has to stay put until the op completes.
+static uint8_t updi_cache_flushing[UPDI_MAX_USER_ROW_SZ] __SECTION_ZERO("retention_mem_area0");
+
+static timer_hnd updi_cache_timer = EASY_TIMER_INVALID_TIMER;
+// Set while a flush's read or write is queued.  Anything written meanwhile waits for it to finish.
+static bool updi_cache_flush_busy;
+// Called once a flush has run its course, see updi_cache_flush_then().
+static updi_cache_done_t updi_cache_flushed_cb;
+// The row can't be read (a locked part), so flushes merge over an erased row instead of the shadow copy.
+static bool updi_cache_unreadable;
+
+
+/**
+ * @brief Applies writes that haven't been flushed yet, so reads see them.
+ */
+static void updi_cache_overlay(uint8_t *data, uint16_t length) {
+    for (uint16_t i = 0; i < length; i++) {
+        if (updi_cache_dirty & ((uint64_t) 1 << i)) {
+            data[i] = updi_cache_pending[i];
+        }
+    }
+}
+
+static void updi_cache_fill(const uint8_t *data, uint16_t length) {
+    memcpy(updi_cache_urow.data, data, length);
+    updi_cache_urow.length = length;
+    updi_cache_urow.valid = true;
+}
+
+/**
+ * @brief Copies out the cached user row, if there is one.
+ *
+ * @param out at least UPDI_MAX_USER_ROW_SZ bytes
+ * @param length set to the length of the row
+ * @return true on a hit.
+ */
+bool updi_cache_user_row(uint8_t *out, uint16_t *length) {
+    if (!updi_cache_urow.valid) {
+        return false;
+    }
+    memcpy(out, updi_cache_urow.data, updi_cache_urow.length);
+    *length = updi_cache_urow.length;
+    updi_cache_overlay(out, *length);
+    return true;
+}
+
+void updi_cache_invalidate() {
+    updi_cache_urow.valid = false;
+}
+
+/**
+ * @brief Called by the op engine as each op completes, before the op's own callback.
+ */
+void updi_cache_op_complete(const updi_op_t *op, updi_err_t err) {
+    switch (op->type) {
+        case UPDI_OP_READ_USER_ROW:
+            if (!err) {
+                updi_cache_fill(op->data, op->length);
+                updi_cache_overlay(op->data, op->length);
+            }
+            break;
+
+        case UPDI_OP_WRITE_USER_ROW:
+            // After a failed write we can't say what the row holds.
+            if (err) {
+                updi_cache_invalidate();
+            } else {
+                updi_cache_fill(op->data, op->length);
+            }
+            break;
+
+        case UPDI_OP_CONNECT:
+            // Writes staged in an earlier session aren't for this one.
+            updi_cache_dirty = 0;
+            updi_cache_unreadable = false;
+            updi_cache_invalidate();
+            break;
+
+        case UPDI_OP_RESET:
+            // Possibly a different target from here on.
+            updi_cache_invalidate();
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+/**
+ * @brief Hands over to whoever is waiting on the flush, once there is nothing more in flight.
+ */
+static void updi_cache_flush_settled() {
+    if (updi_cache_flush_busy || !updi_cache_flushed_cb) {
+        return;
+    }
+    updi_cache_done_t cb = updi_cache_flushed_cb;
+    updi_cache_flushed_cb = NULL;
+    cb();
+}
+
+static void updi_cache_flush_read_done(const updi_op_t *op, updi_err_t err) {
+    uint16_t addr, size;
+    updi_cache_flush_busy = false;
+    if (err == UPDIERR_UNSUPPORTED && updi_device_user_row(&addr, &size)) {
+        // We know where the row is, so it's the part being locked that stops us reading it.  It can still be
+        // written, but whatever the client didn't stage is lost.
+        updi_cache_unreadable = true;
+        updi_cache_flush();
+        return;
+    }
+    if (err) {
+        // Stays pending, for the next flush to have another go.
+        DEBUG_PRINT_STRING("User row flush couldn't read the row\r\n");
+        updi_cache_flush_settled();
+        return;
+    }
+    // The read has filled the shadow copy, so this time round the merge can go ahead.
+    updi_cache_flush();
+}
+
+static void updi_cache_flush_write_done(const updi_op_t *op, updi_err_t err) {
+    updi_cache_flush_busy = false;
+    if (err) {
+        // Stays pending, for the next flush to have another go.
+        DEBUG_PRINT_STRING("User row flush failed\r\n");
+        updi_cache_flush_settled();
+        return;
+    }
+    // Done with what went out, unless it has been written again since with something else.
+    for (uint16_t i = 0; i < op->length; i++) {
+        if (updi_cache_pending[i] == op->data[i]) {
+            updi_cache_dirty &= ~((uint64_t) 1 << i);
+        }
+    }
+    // Anything else written while this one was in flight
+    updi_cache_flush();
+}
+
+/**
+ * @brief Writes any pending user row changes to the target.
+ *
+ * The pending bytes are merged over the shadow copy (reading the row first if there isn't one) and only
+ * written if that changes something.  They stay pending until the write has succeeded.
+ *
+ * @return false if the write couldn't be queued, in which case the changes stay pending.
+ */
+bool updi_cache_flush() {
+    if (updi_cache_timer != EASY_TIMER_INVALID_TIMER) {
+        app_easy_timer_cancel(updi_cache_timer);
+        updi_cache_timer = EASY_TIMER_INVALID_TIMER;
+    }
+    if (updi_cache_flush_busy) {
+        // Whatever is pending goes out once the flush in flight completes.
+        return true;
+    }
+    if (!updi_cache_dirty) {
+        updi_cache_flush_settled();
+        return true;
+    }
+
+    updi_op_t op = {
+        .data = updi_cache_flushing,
+    };
+    if (!updi_cache_urow.valid && !updi_cache_unreadable) {
+        op.type = UPDI_OP_READ_USER_ROW;
+        op.cb = updi_cache_flush_read_done;
+        updi_cache_flush_busy = updi_op_submit(&op);
+        updi_cache_flush_settled();
+        return updi_cache_flush_busy;
+    }
+
+    if (!updi_cache_urow.valid) {
+        memset(updi_cache_flushing, 0xFF, sizeof(updi_cache_flushing));
+        updi_cache_overlay(updi_cache_flushing, sizeof(updi_cache_flushing));
+    } else {
+        memcpy(updi_cache_flushing, updi_cache_urow.data, updi_cache_urow.length);
+        updi_cache_overlay(updi_cache_flushing, updi_cache_urow.length);
+    }
+    if (updi_cache_urow.valid && !memcmp(updi_cache_flushing, updi_cache_urow.data, updi_cache_urow.length)) {
+        // Everything written was already there.
+        updi_cache_dirty = 0;
+        updi_cache_flush_settled();
+        return true;
+    }
+
+    op.type = UPDI_OP_WRITE_USER_ROW;
+    op.cb = updi_cache_flush_write_done;
+    updi_cache_flush_busy = updi_op_submit(&op);
+    updi_cache_flush_settled();
+    return updi_cache_flush_busy;
+}
+
+/**
+ * @brief As updi_cache_flush(), then calls done once the flush has run its course: written, failed (with the
+ * changes left pending), or found nothing to write.  Anything the flush queues on the target comes first, so
+ * done can queue whatever has to follow it.
+ */
+void updi_cache_flush_then(updi_cache_done_t done) {
+    updi_cache_flushed_cb = done;
+    updi_cache_flush();
+}
+
+static void updi_cache_timer_cb() {
+    updi_cache_timer = EASY_TIMER_INVALID_TIMER;
+    updi_cache_flush();
+}
+
+/**
+ * @brief Stages a write of part of the user row, to be written out by updi_cache_flush().
+ *
+ * @return false if it runs off the end of the row.
+ */
+bool updi_cache_write_user_row(uint16_t offset, const uint8_t *data, uint16_t length) {
+    uint16_t addr;
+    uint16_t size = UPDI_MAX_USER_ROW_SZ;
+    updi_device_user_row(&addr, &size);
+    if (offset + length > size) {
+        return false;
+    }
+
+    for (uint16_t i = 0; i < length; i++) {
+        updi_cache_pending[offset + i] = data[i];
+        updi_cache_dirty |= (uint64_t) 1 << (offset + i);
+    }
+
+    if (updi_cache_timer != EASY_TIMER_INVALID_TIMER) {
+        app_easy_timer_cancel(updi_cache_timer);
+    }
+    updi_cache_timer = app_easy_timer(UPDI_CACHE_IDLE_TICKS, updi_cache_timer_cb);
+    return true;
+}
@@ -0,0 +1,288 @@
+#include "updi_device.h"
+#include <stddef.h>
+#include <string.h>
+#include <debug.h>
+
+/**
+ * Memory maps of the parts we know how to program, keyed by signature.  Everything that is common to a family
+ * lives in the family entry, so each part only has to carry its signature and sizes.  The NVM controller
+ * version isn't kept here: that comes from the SIB (see updi_nvm_set_version()).
+ */
+
+typedef struct {
+    // How the family names itself in the SIB, which even a locked part will give us
+    char sib_family[sizeof(((updi_sib_t *) 0)->family_id)];
+    char sib_nvm;
+    uint32_t flash_base;
+    uint16_t eeprom_base;
+    uint16_t eeprom_page_size;
+    uint16_t user_row_addr;
+    uint16_t user_row_size;
+    uint16_t fuse_base;
+} updi_family_t;
+
+typedef struct {
+    uint8_t signature[UPDI_SIGNATURE_SZ];
+    uint8_t flash_kb;
+    uint16_t flash_page_size;
+    uint16_t eeprom_size;
+    const updi_family_t *family;
+} updi_part_t;
+
+
+// tinyAVR 0/1/2 series
+static const updi_family_t updi_family_tiny = {
+    .sib_family = "tinyAVR",
+    .sib_nvm = '0',
+    .flash_base = 0x8000,
+    .eeprom_base = 0x1400,
+    .eeprom_page_size = 32,
+    .user_row_addr = 0x1300,
+    .user_row_size = 32,
+    .fuse_base = 0x1280,
+};
+
+// megaAVR 0 series
+static const updi_family_t updi_family_mega0 = {
+    .sib_family = "megaAVR",
+    .sib_nvm = '0',
+    .flash_base = 0x4000,
+    .eeprom_base = 0x1400,
+    .eeprom_page_size = 64,
+    .user_row_addr = 0x1300,
+    .user_row_size = 64,
+    .fuse_base = 0x1280,
+};
+
+// AVR DA/DB/DD.  EEPROM is written a byte at a time, so its "page" is just how much we hand over at once.
+static const updi_family_t updi_family_dx = {
+    .sib_family = "AVR    ",
+    .sib_nvm = '2',
+    .flash_base = 0x800000,
+    .eeprom_base = 0x1400,
+    .eeprom_page_size = 32,
+    .user_row_addr = 0x1080,
+    .user_row_size = 32,
+    .fuse_base = 0x1050,
+};
+
+// AVR EA.  Names itself the same as Dx in the SIB, but with an NVMCTRL that has page buffers again.
+static const updi_family_t updi_family_ea = {
+    .sib_family = "AVR    ",
+    .sib_nvm = '3',
+    .flash_base = 0x800000,
+    .eeprom_base = 0x1400,
+    .eeprom_page_size = 8,
+    .user_row_addr = 0x1080,
+    .user_row_size = 64,
+    .fuse_base = 0x1050,
+};
+
+#define TINY(sig1, sig2, kb, page, eeprom) { { 0x1E, sig1, sig2 }, kb, page, eeprom, &updi_family_tiny }
+#define MEGA0(sig1, sig2, kb) { { 0x1E, sig1, sig2 }, kb, 128, 256, &updi_family_mega0 }
+#define DX(sig1, sig2, kb) { { 0x1E, sig1, sig2 }, kb, 512, 512, &updi_family_dx }
+#define DD(sig1, sig2, kb) { { 0x1E, sig1, sig2 }, kb, 512, 256, &updi_family_dx }
+#define EA(sig1, sig2, kb, page) { { 0x1E, sig1, sig2 }, kb, page, 512, &updi_family_ea }
+
+static const updi_part_t updi_parts[] = {
+    TINY(0x91, 0x23, 2, 64, 64),    // ATtiny202
+    TINY(0x91, 0x22, 2, 64, 64),    // ATtiny204
+    TINY(0x91, 0x21, 2, 64, 64),    // ATtiny212
+    TINY(0x91, 0x20, 2, 64, 64),    // ATtiny214
+    TINY(0x92, 0x27, 4, 64, 128),   // ATtiny402
+    TINY(0x92, 0x26, 4, 64, 128),   // ATtiny404
+    TINY(0x92, 0x25, 4, 64, 128),   // ATtiny406
+    TINY(0x92, 0x23, 4, 64, 128),   // ATtiny412
+    TINY(0x92, 0x22, 4, 64, 128),   // ATtiny414
+    TINY(0x92, 0x21, 4, 64, 128),   // ATtiny416
+    TINY(0x92, 0x20, 4, 64, 128),   // ATtiny417
+    TINY(0x92, 0x2C, 4, 64, 128),   // ATtiny424
+    TINY(0x92, 0x2B, 4, 64, 128),   // ATtiny426
+    TINY(0x92, 0x2A, 4, 64, 128),   // ATtiny427
+    TINY(0x93, 0x25, 8, 64, 128),   // ATtiny804
+    TINY(0x93, 0x24, 8, 64, 128),   // ATtiny806
+    TINY(0x93, 0x23, 8, 64, 128),   // ATtiny807
+    TINY(0x93, 0x22, 8, 64, 128),   // ATtiny814
+    TINY(0x93, 0x21, 8, 64, 128),   // ATtiny816
+    TINY(0x93, 0x20, 8, 64, 128),   // ATtiny817
+    TINY(0x93, 0x29, 8, 64, 128),   // ATtiny824
+    TINY(0x93, 0x28, 8, 64, 128),   // ATtiny826
+    TINY(0x93, 0x27, 8, 64, 128),   // ATtiny827
+    TINY(0x94, 0x25, 16, 64, 256),  // ATtiny1604
+    TINY(0x94, 0x24, 16, 64, 256),  // ATtiny1606
+    TINY(0x94, 0x23, 16, 64, 256),  // ATtiny1607
+    TINY(0x94, 0x22, 16, 64, 256),  // ATtiny1614
+    TINY(0x94, 0x21, 16, 64, 256),  // ATtiny1616
+    TINY(0x94, 0x20, 16, 64, 256),  // ATtiny1617
+    TINY(0x94, 0x2A, 16, 64, 256),  // ATtiny1624
+    TINY(0x94, 0x29, 16, 64, 256),  // ATtiny1626
+    TINY(0x94, 0x28, 16, 64, 256),  // ATtiny1627
+    TINY(0x95, 0x21, 32, 128, 256), // ATtiny3216
+    TINY(0x95, 0x22, 32, 128, 256), // ATtiny3217
+    TINY(0x95, 0x28, 32, 128, 256), // ATtiny3224
+    TINY(0x95, 0x27, 32, 128, 256), // ATtiny3226
+    TINY(0x95, 0x26, 32, 128, 256), // ATtiny3227
+
+    MEGA0(0x93, 0x26, 8),           // ATmega808
+    MEGA0(0x93, 0x2A, 8),           // ATmega809
+    MEGA0(0x94, 0x27, 16),          // ATmega1608
+    MEGA0(0x94, 0x26, 16),          // ATmega1609
+    MEGA0(0x95, 0x30, 32),          // ATmega3208
+    MEGA0(0x95, 0x31, 32),          // ATmega3209
+    MEGA0(0x96, 0x50, 48),          // ATmega4808
+    MEGA0(0x96, 0x51, 48),          // ATmega4809
+
+    DX(0x95, 0x34, 32),             // AVR32DA28
+    DX(0x95, 0x33, 32),             // AVR32DA32
+    DX(0x95, 0x32, 32),             // AVR32DA48
+    DX(0x96, 0x15, 64),             // AVR64DA28
+    DX(0x96, 0x14, 64),             // AVR64DA32
+    DX(0x96, 0x13, 64),             // AVR64DA48
+    DX(0x96, 0x12, 64),             // AVR64DA64
+    DX(0x97, 0x0A, 128),            // AVR128DA28
+    DX(0x97, 0x09, 128),            // AVR128DA32
+    DX(0x97, 0x08, 128),            // AVR128DA48
+    DX(0x97, 0x07, 128),            // AVR128DA64
+    DX(0x95, 0x37, 32),             // AVR32DB28
+    DX(0x95, 0x36, 32),             // AVR32DB32
+    DX(0x95, 0x35, 32),             // AVR32DB48
+    DX(0x96, 0x19, 64),             // AVR64DB28
+    DX(0x96, 0x18, 64),             // AVR64DB32
+    DX(0x96, 0x17, 64),             // AVR64DB48
+    DX(0x96, 0x16, 64),             // AVR64DB64
+    DX(0x97, 0x0E, 128),            // AVR128DB28
+    DX(0x97, 0x0D, 128),            // AVR128DB32
+    DX(0x97, 0x0C, 128),            // AVR128DB48
+    DX(0x97, 0x0B, 128),            // AVR128DB64
+    DD(0x94, 0x34, 16),             // AVR16DD14
+    DD(0x94, 0x33, 16),             // AVR16DD20
+    DD(0x94, 0x32, 16),             // AVR16DD28
+    DD(0x94, 0x31, 16),             // AVR16DD32
+    DD(0x95, 0x3B, 32),             // AVR32DD14
+    DD(0x95, 0x3A, 32),             // AVR32DD20
+    DD(0x95, 0x39, 32),             // AVR32DD28
+    DD(0x95, 0x38, 32),             // AVR32DD32
+    DD(0x96, 0x1D, 64),             // AVR64DD14
+    DD(0x96, 0x1C, 64),             // AVR64DD20
+    DD(0x96, 0x1B, 64),             // AVR64DD28
+    DD(0x96, 0x1A, 64),             // AVR64DD32
+
+    EA(0x93, 0x2C, 8, 64),          // AVR8EA28
+    EA(0x93, 0x2B, 8, 64),          // AVR8EA32
+    EA(0x94, 0x37, 16, 64),         // AVR16EA28
+    EA(0x94, 0x36, 16, 64),         // AVR16EA32
+    EA(0x94, 0x35, 16, 64),         // AVR16EA48
+    EA(0x95, 0x3E, 32, 64),         // AVR32EA28
+    EA(0x95, 0x3D, 32, 64),         // AVR32EA32
+    EA(0x95, 0x3C, 32, 64),         // AVR32EA48
+    EA(0x96, 0x20, 64, 128),        // AVR64EA28
+    EA(0x96, 0x1F, 64, 128),        // AVR64EA32
+    EA(0x96, 0x1E, 64, 128),        // AVR64EA48
+};
+
+static const updi_family_t * const updi_families[] = {
+    &updi_family_tiny,
+    &updi_family_mega0,
+    &updi_family_dx,
+    &updi_family_ea,
+};
+
+
+// The connected target, valid while updi_device_known is set.
+static updi_device_t updi_device_current;
+static bool updi_device_known;
+// Its family as told by the SIB, or NULL.  Known even when the part itself isn't.
+static const updi_family_t *updi_device_family;
+
+
+/**
+ * @brief Works out the target's family from its SIB.  That's as much as a locked part will say about itself,
+ * but it is enough to find the user row.
+ */
+void updi_device_set_sib(const updi_sib_t *sib) {
+    updi_device_family = NULL;
+    for (uint8_t i = 0; i < sizeof(updi_families) / sizeof(updi_families[0]); i++) {
+        const updi_family_t *family = updi_families[i];
+        if (!memcmp(family->sib_family, sib->family_id, sizeof(sib->family_id)) &&
+                family->sib_nvm == sib->nvm_version[2]) {
+            updi_device_family = family;
+            return;
+        }
+    }
+    DEBUG_PRINT_STRING("Unknown family\r\n");
+}
+
+
+/**
+ * @brief Looks the part up by the signature read from UPDI_SIGROW_ADDR, and makes it the current target.
+ *
+ * @return const updi_device_t* the memory map, or NULL if the part isn't in the table (and there is then no
+ * current target).
+ */
+const updi_device_t *updi_device_lookup(const uint8_t *signature) {
+    updi_device_known = false;
+
+    for (uint8_t i = 0; i < sizeof(updi_parts) / sizeof(updi_parts[0]); i++) {
+        const updi_part_t *part = &updi_parts[i];
+        if (part->signature[0] != signature[0] || part->signature[1] != signature[1] || part->signature[2] != signature[2]) {
+            continue;
+        }
+
+        const updi_family_t *family = part->family;
+        updi_device_t *dev = &updi_device_current;
+        for (uint8_t j = 0; j < UPDI_SIGNATURE_SZ; j++) {
+            dev->signature[j] = signature[j];
+        }
+        dev->flash_base = family->flash_base;
+        dev->flash_size = (uint32_t) part->flash_kb * 1024;
+        dev->flash_page_size = part->flash_page_size;
+        dev->eeprom_base = family->eeprom_base;
+        dev->eeprom_size = part->eeprom_size;
+        dev->eeprom_page_size = family->eeprom_page_size;
+        dev->user_row_addr = family->user_row_addr;
+        dev->user_row_size = family->user_row_size;
+        dev->fuse_base = family->fuse_base;
+        updi_device_known = true;
+        return dev;
+    }
+
+    DEBUG_PRINT_STRING("Unknown signature ");
+    for (uint8_t j = 0; j < UPDI_SIGNATURE_SZ; j++) {
+        DEBUG_PRINT_INT(signature[j]);
+        DEBUG_PRINT_STRING(" ");
+    }
+    DEBUG_PRINT_STRING("\r\n");
+    return NULL;
+}
+
+/**
+ * @brief The memory map of the connected target, or NULL if it hasn't been identified.
+ */
+const updi_device_t *updi_device() {
+    return updi_device_known ? &updi_device_current : NULL;
+}
+
+/**
+ * @brief Where the connected target's user row is.  Falls back on the family from the SIB when the part hasn't
+ * been identified, which is how a locked part's user row is found.
+ *
+ * @return false if not even the family is known.
+ */
+bool updi_device_user_row(uint16_t *addr, uint16_t *size) {
+    if (updi_device_known) {
+        *addr = updi_device_current.user_row_addr;
+        *size = updi_device_current.user_row_size;
+        return true;
+    }
+    if (!updi_device_family) {
+        return false;
+    }
+    *addr = updi_device_family->user_row_addr;
+    *size = updi_device_family->user_row_size;
+    return true;
+}
+
+void updi_device_forget() {
+    updi_device_known = false;
+    updi_device_family = NULL;
+}
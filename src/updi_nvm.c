@@ -0,0 +1,476 @@
+#include "updi_nvm.h"
+#include <debug.h>
+
+/**
+ * NVM controller driver.  Page programming is split into phases, so that the caller (the op engine) can poll
+ * updi_nvm_busy() between them without blocking:
+ * 
+ *   prepare  - clear the page buffer (v0, v3) or erase the page and arm the write command (v2)
+ *   load     - stream the data into the page buffer (v0, v3) or straight into flash/EEPROM (v2).  v2 EEPROM
+ *              takes a byte at a time, with the controller waited on in between (see updi_nvm_load_unit()).
+ *   commit   - erase-write the page buffer into the page (v0, v3).  Nothing to do on v2.
+ *   finish   - clear the command (v2, v3)
+ * 
+ * Each controller version gets its own table of operations, picked once per session from the SIB, so nothing
+ * past updi_nvm_set_version() needs to look at the version again.
+ * 
+ * Addresses are UPDI data space addresses, i.e. flash is at its mapped location (0x8000 on tinyAVR, 0x800000
+ * on AVR Dx/Ex parts).
+ */
+
+#define UPDI_NVMCTRL_BASE 0x1000
+#define UPDI_CRCSCAN_BASE 0x0120
+
+//CRCSCAN
+#define UPDI_CRCSCAN_CTRLA 0x00
+#define UPDI_CRCSCAN_CTRLB 0x01
+#define UPDI_CRCSCAN_STATUS 0x02
+
+#define UPDI_CRCSCAN_CTRLA_RESET 7
+#define UPDI_CRCSCAN_CTRLA_ENABLE 0
+#define UPDI_CRCSCAN_CTRLB_SRC_FLASH 0x00
+#define UPDI_CRCSCAN_STATUS_OK 1
+#define UPDI_CRCSCAN_STATUS_BUSY 0
+
+//FLASH CONTROLLER
+#define UPDI_NVMCTRL_CTRLA 0x00
+#define UPDI_NVMCTRL_CTRLB 0x01
+#define UPDI_NVMCTRL_STATUS 0x02
+#define UPDI_NVMCTRL_INTCTRL 0x03
+#define UPDI_NVMCTRL_INTFLAGS 0x04
+#define UPDI_NVMCTRL_DATAL 0x06
+#define UPDI_NVMCTRL_DATAH 0x07
+#define UPDI_NVMCTRL_ADDRL 0x08
+#define UPDI_NVMCTRL_ADDRH 0x09
+
+//NVMCTRL v0 CTRLA
+#define UPDI_V0_NVMCTRL_CTRLA_NOP 0x00
+#define UPDI_V0_NVMCTRL_CTRLA_WRITE_PAGE 0x01
+#define UPDI_V0_NVMCTRL_CTRLA_ERASE_PAGE 0x02
+#define UPDI_V0_NVMCTRL_CTRLA_ERASE_WRITE_PAGE 0x03
+#define UPDI_V0_NVMCTRL_CTRLA_PAGE_BUFFER_CLR 0x04
+#define UPDI_V0_NVMCTRL_CTRLA_CHIP_ERASE 0x05
+#define UPDI_V0_NVMCTRL_CTRLA_ERASE_EEPROM 0x06
+#define UPDI_V0_NVMCTRL_CTRLA_WRITE_FUSE 0x07
+
+//NVMCTRL v2 CTRLA
+#define UPDI_V2_NVMCTRL_CTRLA_NOCMD 0x00
+#define UPDI_V2_NVMCTRL_CTRLA_FLASH_WRITE 0x02
+#define UPDI_V2_NVMCTRL_CTRLA_FLASH_PAGE_ERASE 0x08
+#define UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE_WRITE 0x13
+#define UPDI_V2_NVMCTRL_CTRLA_CHIP_ERASE 0x20
+#define UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE 0x30
+
+//NVMCTRL v3 CTRLA
+#define UPDI_V3_NVMCTRL_CTRLA_NOCMD 0x00
+#define UPDI_V3_NVMCTRL_CTRLA_NOP 0x01
+#define UPDI_V3_NVMCTRL_CTRLA_FLASH_PAGE_WRITE 0x04
+#define UPDI_V3_NVMCTRL_CTRLA_FLASH_PAGE_ERASE_WRITE 0x05
+#define UPDI_V3_NVMCTRL_CTRLA_FLASH_PAGE_ERASE 0x08
+#define UPDI_V3_NVMCTRL_CTRLA_FLASH_PAGE_BUFFER_CLEAR 0x0F
+#define UPDI_V3_NVMCTRL_CTRLA_EEPROM_PAGE_WRITE 0x14
+#define UPDI_V3_NVMCTRL_CTRLA_EEPROM_PAGE_ERASE_WRITE 0x15
+#define UPDI_V3_NVMCTRL_CTRLA_EEPROM_PAGE_ERASE 0x17
+#define UPDI_V3_NVMCTRL_CTRLA_EEPROM_PAGE_BUFFER_CLEAR 0x1F
+#define UPDI_V3_NVMCTRL_CTRLA_CHIP_ERASE 0x20
+#define UPDI_V3_NVMCTRL_CTRLA_EEPROM_ERASE 0x30
+
+#define UPDI_NVM_STATUS_WRITE_ERROR 2
+#define UPDI_NVM_STATUS_EEPROM_BUSY 1
+#define UPDI_NVM_STATUS_FLASH_BUSY 0
+#define UPDI_NVM_STATUS_BUSY_MASK ((1 << UPDI_NVM_STATUS_FLASH_BUSY) | (1 << UPDI_NVM_STATUS_EEPROM_BUSY))
+// NVMCTRL v2/v3 STATUS ERROR field
+#define UPDI_V2_NVM_STATUS_ERROR_MASK 0x70
+
+
+typedef struct {
+    // NVMCTRL.STATUS bits that mean the last command failed
+    uint8_t error_mask;
+    // Which set of commands programs the user row
+    updi_nvm_mem_t user_row_mem;
+    // Most EEPROM bytes that can be loaded before the controller has to be waited on, or 0 for a whole page
+    uint16_t eeprom_load_unit;
+    updi_err_t (*page_prepare)(updi_nvm_mem_t mem, uint32_t address);
+    updi_err_t (*page_load)(updi_nvm_mem_t mem, uint32_t address, const uint8_t *data, uint16_t len);
+    updi_err_t (*page_commit)(updi_nvm_mem_t mem);
+    updi_err_t (*page_finish)();
+    updi_err_t (*page_erase)(updi_nvm_mem_t mem, uint32_t address);
+    updi_err_t (*chip_erase)();
+    updi_err_t (*eeprom_erase)();
+} updi_nvm_ops_t;
+
+
+static updi_err_t updi_nvm_command(uint8_t cmd) {
+    return updi_st(UPDI_NVMCTRL_BASE + UPDI_NVMCTRL_CTRLA, cmd);
+}
+
+/**
+ * @brief v2 and v3 controllers want the previous command cleared before a new one is written.
+ */
+static updi_err_t updi_nvm_change_command(uint8_t cmd) {
+    updi_err_t err = updi_nvm_command(UPDI_V2_NVMCTRL_CTRLA_NOCMD);
+    if (err) {
+        return err;
+    }
+    return updi_nvm_command(cmd);
+}
+
+/**
+ * @brief Runs a command that v2 and v3 controllers trigger with a dummy write into the area it applies to.
+ */
+static updi_err_t updi_nvm_triggered_command(uint8_t cmd, uint32_t address) {
+    updi_err_t err = updi_nvm_change_command(cmd);
+    if (err) {
+        return err;
+    }
+    return updi_st(address, 0xFF);
+}
+
+static updi_err_t updi_nvm_no_op() {
+    return UPDI_OK;
+}
+
+static updi_err_t updi_nvm_clear_command() {
+    return updi_nvm_command(UPDI_V2_NVMCTRL_CTRLA_NOCMD);
+}
+
+static updi_err_t updi_nvm_write_through(updi_nvm_mem_t mem, uint32_t address, const uint8_t *data, uint16_t len) {
+    return updi_write_data(address, data, len);
+}
+
+
+/* NVMCTRL v0: tinyAVR 0/1/2 and megaAVR 0 */
+
+static updi_err_t updi_nvm_v0_page_prepare(updi_nvm_mem_t mem, uint32_t address) {
+    return updi_nvm_command(UPDI_V0_NVMCTRL_CTRLA_PAGE_BUFFER_CLR);
+}
+
+static updi_err_t updi_nvm_v0_page_commit(updi_nvm_mem_t mem) {
+    // Erase-writes whichever page the buffer was loaded for
+    return updi_nvm_command(UPDI_V0_NVMCTRL_CTRLA_ERASE_WRITE_PAGE);
+}
+
+static updi_err_t updi_nvm_v0_page_erase(updi_nvm_mem_t mem, uint32_t address) {
+    // The page to erase is picked by writing into its buffer
+    updi_err_t err = updi_st(address, 0xFF);
+    if (err) {
+        return err;
+    }
+    return updi_nvm_command(UPDI_V0_NVMCTRL_CTRLA_ERASE_PAGE);
+}
+
+static updi_err_t updi_nvm_v0_chip_erase() {
+    return updi_nvm_command(UPDI_V0_NVMCTRL_CTRLA_CHIP_ERASE);
+}
+
+static updi_err_t updi_nvm_v0_eeprom_erase() {
+    return updi_nvm_command(UPDI_V0_NVMCTRL_CTRLA_ERASE_EEPROM);
+}
+
+static const updi_nvm_ops_t updi_nvm_v0_ops = {
+    .error_mask = 1 << UPDI_NVM_STATUS_WRITE_ERROR,
+    .user_row_mem = UPDI_NVM_EEPROM,
+    .eeprom_load_unit = 0,
+    .page_prepare = updi_nvm_v0_page_prepare,
+    .page_load = updi_nvm_write_through,
+    .page_commit = updi_nvm_v0_page_commit,
+    .page_finish = updi_nvm_no_op,
+    .page_erase = updi_nvm_v0_page_erase,
+    .chip_erase = updi_nvm_v0_chip_erase,
+    .eeprom_erase = updi_nvm_v0_eeprom_erase,
+};
+
+
+/* NVMCTRL v2: AVR DA/DB/DD.  No page buffer, so data goes straight into the flash or EEPROM. */
+
+static updi_err_t updi_nvm_v2_page_prepare(updi_nvm_mem_t mem, uint32_t address) {
+    if (mem == UPDI_NVM_EEPROM) {
+        // EEPROM bytes are erase-written as they are stored, so just arm the command.
+        return updi_nvm_change_command(UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE_WRITE);
+    }
+    return updi_nvm_triggered_command(UPDI_V2_NVMCTRL_CTRLA_FLASH_PAGE_ERASE, address);
+}
+
+static updi_err_t updi_nvm_v2_page_load(updi_nvm_mem_t mem, uint32_t address, const uint8_t *data, uint16_t len) {
+    if (mem == UPDI_NVM_EEPROM) {
+        // Erase-written as it is stored.  Only ever a byte, as eeprom_load_unit has the caller wait in between.
+        return updi_write_data(address, data, len);
+    }
+    updi_err_t err = updi_nvm_change_command(UPDI_V2_NVMCTRL_CTRLA_FLASH_WRITE);
+    if (err) {
+        return err;
+    }
+    return updi_write_data(address, data, len);
+}
+
+static updi_err_t updi_nvm_v2_page_commit(updi_nvm_mem_t mem) {
+    // The data was written as it was loaded
+    return UPDI_OK;
+}
+
+static updi_err_t updi_nvm_v2_page_erase(updi_nvm_mem_t mem, uint32_t address) {
+    if (mem == UPDI_NVM_EEPROM) {
+        // EEPROM has no pages on v2, so a page erase is a 0xFF erase-write of the byte.
+        return updi_nvm_triggered_command(UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE_WRITE, address);
+    }
+    return updi_nvm_triggered_command(UPDI_V2_NVMCTRL_CTRLA_FLASH_PAGE_ERASE, address);
+}
+
+static updi_err_t updi_nvm_v2_chip_erase() {
+    return updi_nvm_change_command(UPDI_V2_NVMCTRL_CTRLA_CHIP_ERASE);
+}
+
+static updi_err_t updi_nvm_v2_eeprom_erase() {
+    return updi_nvm_change_command(UPDI_V2_NVMCTRL_CTRLA_EEPROM_ERASE);
+}
+
+static const updi_nvm_ops_t updi_nvm_v2_ops = {
+    .error_mask = UPDI_V2_NVM_STATUS_ERROR_MASK,
+    .user_row_mem = UPDI_NVM_FLASH,
+    .eeprom_load_unit = 1,
+    .page_prepare = updi_nvm_v2_page_prepare,
+    .page_load = updi_nvm_v2_page_load,
+    .page_commit = updi_nvm_v2_page_commit,
+    .page_finish = updi_nvm_clear_command,
+    .page_erase = updi_nvm_v2_page_erase,
+    .chip_erase = updi_nvm_v2_chip_erase,
+    .eeprom_erase = updi_nvm_v2_eeprom_erase,
+};
+
+
+/* NVMCTRL v3: AVR EA.  Page buffer again, with separate flash and EEPROM commands. */
+
+static updi_err_t updi_nvm_v3_page_prepare(updi_nvm_mem_t mem, uint32_t address) {
+    return updi_nvm_change_command(mem == UPDI_NVM_FLASH ?
+        UPDI_V3_NVMCTRL_CTRLA_FLASH_PAGE_BUFFER_CLEAR : UPDI_V3_NVMCTRL_CTRLA_EEPROM_PAGE_BUFFER_CLEAR);
+}
+
+static updi_err_t updi_nvm_v3_page_commit(updi_nvm_mem_t mem) {
+    return updi_nvm_change_command(mem == UPDI_NVM_FLASH ?
+        UPDI_V3_NVMCTRL_CTRLA_FLASH_PAGE_ERASE_WRITE : UPDI_V3_NVMCTRL_CTRLA_EEPROM_PAGE_ERASE_WRITE);
+}
+
+static updi_err_t updi_nvm_v3_page_erase(updi_nvm_mem_t mem, uint32_t address) {
+    return updi_nvm_triggered_command(mem == UPDI_NVM_FLASH ?
+        UPDI_V3_NVMCTRL_CTRLA_FLASH_PAGE_ERASE : UPDI_V3_NVMCTRL_CTRLA_EEPROM_PAGE_ERASE, address);
+}
+
+static updi_err_t updi_nvm_v3_chip_erase() {
+    return updi_nvm_change_command(UPDI_V3_NVMCTRL_CTRLA_CHIP_ERASE);
+}
+
+static updi_err_t updi_nvm_v3_eeprom_erase() {
+    return updi_nvm_change_command(UPDI_V3_NVMCTRL_CTRLA_EEPROM_ERASE);
+}
+
+static const updi_nvm_ops_t updi_nvm_v3_ops = {
+    .error_mask = UPDI_V2_NVM_STATUS_ERROR_MASK,
+    .user_row_mem = UPDI_NVM_FLASH,
+    .eeprom_load_unit = 0,
+    .page_prepare = updi_nvm_v3_page_prepare,
+    .page_load = updi_nvm_write_through,
+    .page_commit = updi_nvm_v3_page_commit,
+    .page_finish = updi_nvm_clear_command,
+    .page_erase = updi_nvm_v3_page_erase,
+    .chip_erase = updi_nvm_v3_chip_erase,
+    .eeprom_erase = updi_nvm_v3_eeprom_erase,
+};
+
+
+/* Anything else, including no target at all.  Everything fails. */
+
+static updi_err_t updi_nvm_unsupported() {
+    return UPDIERR_UNSUPPORTED;
+}
+
+static updi_err_t updi_nvm_unsupported_page(updi_nvm_mem_t mem, uint32_t address) {
+    return UPDIERR_UNSUPPORTED;
+}
+
+static updi_err_t updi_nvm_unsupported_load(updi_nvm_mem_t mem, uint32_t address, const uint8_t *data, uint16_t len) {
+    return UPDIERR_UNSUPPORTED;
+}
+
+static updi_err_t updi_nvm_unsupported_commit(updi_nvm_mem_t mem) {
+    return UPDIERR_UNSUPPORTED;
+}
+
+static const updi_nvm_ops_t updi_nvm_unsupported_ops = {
+    .error_mask = 0,
+    .user_row_mem = UPDI_NVM_FLASH,
+    .eeprom_load_unit = 0,
+    .page_prepare = updi_nvm_unsupported_page,
+    .page_load = updi_nvm_unsupported_load,
+    .page_commit = updi_nvm_unsupported_commit,
+    .page_finish = updi_nvm_unsupported,
+    .page_erase = updi_nvm_unsupported_page,
+    .chip_erase = updi_nvm_unsupported,
+    .eeprom_erase = updi_nvm_unsupported,
+};
+
+
+// Indexed by the version digit in the SIB.  Gaps are versions we don't know how to drive.
+static const updi_nvm_ops_t * const updi_nvm_versions[] = {
+    &updi_nvm_v0_ops,
+    NULL,
+    &updi_nvm_v2_ops,
+    &updi_nvm_v3_ops,
+};
+
+// Operations for the connected target
+static const updi_nvm_ops_t *updi_nvm_ops = &updi_nvm_unsupported_ops;
+// The version digit they were picked by
+static uint8_t updi_nvm_version_current = UPDI_NVM_VERSION_UNKNOWN;
+
+
+/**
+ * @brief Picks the NVM controller operations for the target, from the version digit in its SIB (e.g. "P:2")
+ * 
+ * @return updi_err_t UPDIERR_UNSUPPORTED if the controller version isn't one we know.  Reads still work, but
+ * every NVM operation will fail until a supported target is connected.
+ */
+updi_err_t updi_nvm_set_version(const updi_sib_t *sib) {
+    uint8_t version = sib->nvm_version[2] - '0';
+
+    DEBUG_PRINT_STRING("NVM version ");
+    DEBUG_PRINT_INT(version);
+    DEBUG_PRINT_STRING("\r\n");
+
+    updi_nvm_version_current = version;
+    updi_nvm_ops = &updi_nvm_unsupported_ops;
+    if (version < sizeof(updi_nvm_versions) / sizeof(updi_nvm_versions[0]) && updi_nvm_versions[version]) {
+        updi_nvm_ops = updi_nvm_versions[version];
+    }
+    return updi_nvm_ops == &updi_nvm_unsupported_ops ? UPDIERR_UNSUPPORTED : UPDI_OK;
+}
+
+/**
+ * @brief The connected target's NVM controller version, as given by its SIB.  UPDI_NVM_VERSION_UNKNOWN until
+ * one has been read.
+ */
+uint8_t updi_nvm_version() {
+    return updi_nvm_version_current;
+}
+
+/**
+ * @brief Reads NVMCTRL.STATUS
+ * 
+ * @param busy set if either flash or EEPROM is still busy
+ * @param check_errors whether to look at the error bits.  These stay latched from a failed write until the next
+ * command, so they only mean something once we have issued one of our own.
+ * @return updi_err_t UPDIERR_WRITE_FAILED if check_errors and the controller has flagged an error.
+ */
+updi_err_t updi_nvm_busy(bool *busy, bool check_errors) {
+    uint8_t status;
+    updi_err_t err = updi_ld(UPDI_NVMCTRL_BASE + UPDI_NVMCTRL_STATUS, &status);
+    if (err) {
+        return err;
+    }
+    *busy = (status & UPDI_NVM_STATUS_BUSY_MASK) != 0;
+    if (check_errors && (status & updi_nvm_ops->error_mask)) {
+        return UPDIERR_WRITE_FAILED;
+    }
+    return UPDI_OK;
+}
+
+/**
+ * @brief The user row is programmed like EEPROM on v0 controllers, and like flash on later ones.
+ */
+updi_nvm_mem_t updi_nvm_user_row_mem() {
+    return updi_nvm_ops->user_row_mem;
+}
+
+/**
+ * @brief How much of a page can go to updi_nvm_page_load() at once.  Anything less than the page has to be
+ * loaded in pieces, polling updi_nvm_busy() until idle after each one.
+ *
+ * @return the most bytes per load, or 0 for the whole page.
+ */
+uint16_t updi_nvm_load_unit(updi_nvm_mem_t mem) {
+    return mem == UPDI_NVM_EEPROM ? updi_nvm_ops->eeprom_load_unit : 0;
+}
+
+updi_err_t updi_nvm_page_prepare(updi_nvm_mem_t mem, uint32_t address) {
+    return updi_nvm_ops->page_prepare(mem, address);
+}
+
+updi_err_t updi_nvm_page_load(updi_nvm_mem_t mem, uint32_t address, const uint8_t *data, uint16_t len) {
+    return updi_nvm_ops->page_load(mem, address, data, len);
+}
+
+updi_err_t updi_nvm_page_commit(updi_nvm_mem_t mem) {
+    return updi_nvm_ops->page_commit(mem);
+}
+
+updi_err_t updi_nvm_page_finish() {
+    return updi_nvm_ops->page_finish();
+}
+
+/**
+ * @brief Erases the page (or on v2 EEPROM, the byte) at address.  Poll updi_nvm_busy() then updi_nvm_page_finish().
+ */
+updi_err_t updi_nvm_page_erase(updi_nvm_mem_t mem, uint32_t address) {
+    return updi_nvm_ops->page_erase(mem, address);
+}
+
+/**
+ * @brief Erases flash and EEPROM (unless EESAVE is set) through the controller, which unlike the CHIPERASE key
+ * needs the target unlocked and in programming mode.  Poll updi_nvm_busy() then updi_nvm_page_finish().
+ */
+updi_err_t updi_nvm_chip_erase() {
+    return updi_nvm_ops->chip_erase();
+}
+
+updi_err_t updi_nvm_eeprom_erase() {
+    return updi_nvm_ops->eeprom_erase();
+}
+
+
+/**
+ * @brief Starts the target's CRCSCAN over the whole of flash.  The scan checks flash against the CRC stored in
+ * its last bytes, so the image has to have been built with one appended.
+ */
+updi_err_t updi_nvm_scan_start() {
+    updi_err_t err = updi_st(UPDI_CRCSCAN_BASE + UPDI_CRCSCAN_CTRLA, 1 << UPDI_CRCSCAN_CTRLA_RESET);
+    if (err) {
+        return err;
+    }
+    err = updi_st(UPDI_CRCSCAN_BASE + UPDI_CRCSCAN_CTRLB, UPDI_CRCSCAN_CTRLB_SRC_FLASH);
+    if (err) {
+        return err;
+    }
+    return updi_st(UPDI_CRCSCAN_BASE + UPDI_CRCSCAN_CTRLA, 1 << UPDI_CRCSCAN_CTRLA_ENABLE);
+}
+
+/**
+ * @brief Checks on a scan started by updi_nvm_scan_start().
+ *
+ * @param busy set while the scan is still running
+ * @return updi_err_t UPDIERR_VERIFY_FAILED once the scan has finished with a mismatch.
+ */
+updi_err_t updi_nvm_scan_status(bool *busy) {
+    uint8_t status;
+    updi_err_t err = updi_read_crc_status(&status);
+    if (err) {
+        return err;
+    }
+
+    if (status == UPDI_ASI_CRC_STATUS_NOT_ENABLED) {
+        // Parts that only report the boot time scan in ASI_CRC_STATUS.  Ask the peripheral instead.
+        err = updi_ld(UPDI_CRCSCAN_BASE + UPDI_CRCSCAN_STATUS, &status);
+        if (err) {
+            return err;
+        }
+        *busy = (status & (1 << UPDI_CRCSCAN_STATUS_BUSY)) != 0;
+        if (!*busy && !(status & (1 << UPDI_CRCSCAN_STATUS_OK))) {
+            return UPDIERR_VERIFY_FAILED;
+        }
+        return UPDI_OK;
+    }
+
+    *busy = status == UPDI_ASI_CRC_STATUS_BUSY;
+    if (status == UPDI_ASI_CRC_STATUS_FAILED) {
+        return UPDIERR_VERIFY_FAILED;
+    }
+    return UPDI_OK;
+}
@@ -0,0 +1,1078 @@
+#include "updi_op.h"
+#include "updi_nvm.h"
+#include "updi_device.h"
+#include "updi_cache.h"
+#include "timebase.h"
+#include <rwip_config.h>
+#include <ke_msg.h>
+#include <app_easy_msg_utils.h>
+#include <app_easy_timer.h>
+#include <arch_api.h>
+#include <debug.h>
+
+/**
+ * Non-blocking UPDI operation engine.
+ *
+ * Each operation is broken up into steps, where a step is at most one short UPDI transaction (a key, an
+ * LDCS, a single repeat block).  After each step the engine posts a message to itself and returns, so the
+ * kernel gets to service the BLE stack between steps.  Steps that wait on the target (e.g. for it to come out
+ * of reset) poll a few times back to back, then back off onto an app_easy_timer tick.
+ *
+ * Operations are queued, and executed one at a time in the order they were submitted.  The system is kept out of
+ * extended sleep while any are queued: waking re-initialises UART2 and the UPDI pad, which would end a break
+ * being held, and throw away a reply on its way in.
+ */
+
+// Number of polls before we back off from back-to-back messages onto the (10ms) timer.
+#define UPDI_OP_FAST_POLLS 20
+// Total number of polls before a wait step gives up.  20 fast ones, then another 30 x 10ms.
+#define UPDI_OP_MAX_POLLS 50
+// Ticks to hold a break for.  Timers can fire up to a tick early, so one more than UPDI_BREAK_MS needs.
+#define UPDI_OP_BREAK_TICKS ((UPDI_BREAK_MS + 9) / 10 + 1)
+
+// Link faults an op can recover from (by resyncing and retrying the step) before it fails.
+#define UPDI_OP_MAX_RETRIES 3
+
+// Longest a piece of a page load can keep the controller busy: a v2 EEPROM byte is 11ms at worst.
+#define UPDI_OP_LOAD_WAIT_US 20000
+
+typedef enum {
+    UPDI_STEP_CONTINUE, // Run op->step on the next message
+    UPDI_STEP_POLL,     // Run the same step again, counting it against the poll limit
+    UPDI_STEP_SLEEP,    // Run op->step after updi_op_sleep_ticks
+    UPDI_STEP_DONE,     // Operation completed successfully
+    UPDI_STEP_FAILED    // Operation failed, with op->err set
+} updi_step_t;
+
+static updi_op_t updi_op_queue[UPDI_OP_QUEUE_SZ];
+static uint8_t updi_op_head;
+static uint8_t updi_op_count;
+
+// Landing zone for streaming reads, between the wire and the sink.
+static uint8_t updi_op_window[UPDI_STREAM_WINDOW];
+
+/**
+ * What we know about the target, so that ops can skip probes whose answer we already have, and avoid the
+ * key/reset dance when the target is already where they need it.  Anything that could leave us unsure (a
+ * failed op, a break) drops UPDI_SESSION_KNOWN, and the next op that cares probes again.
+ */
+#define UPDI_SESSION_LINK 0x01      // Link is up at the negotiated rate
+#define UPDI_SESSION_KNOWN 0x02     // The bits below reflect the target
+#define UPDI_SESSION_UNLOCKED 0x04
+#define UPDI_SESSION_NVMPROG 0x08
+#define UPDI_SESSION_UROWPROG 0x10
+
+static uint8_t updi_session;
+
+// Private op flag: write the user row through the NVM controller rather than the UROWWRITE key.
+#define UPDI_OP_FLAG_VIA_NVM 0x80
+// Private op flag: the op failed because resyncing couldn't keep the link up, rather than the target.
+#define UPDI_OP_FLAG_LINK_LOST 0x40
+
+static uint8_t updi_op_sleep_ticks;
+
+static ke_msg_id_t updi_op_msg;
+static bool updi_op_scheduled;
+static timer_hnd updi_op_timer = EASY_TIMER_INVALID_TIMER;
+// A wait (in ticks) still owed because no timer was free when it was asked for.
+static uint8_t updi_op_deferred;
+// Set by a step that polls against a time limit rather than UPDI_OP_MAX_POLLS.  Ends when the step moves on.
+static timebase_deadline_t updi_op_deadline;
+// Whether we have sleep held off, so the SDK's force/restore calls stay paired.
+static bool updi_op_awake;
+
+/**
+ * Link recovery that takes a break, run as steps of its own ahead of the op's (which are left where they are, to
+ * carry on from once the link is back).  updi_relink_step is RELINK_IDLE when there's none going.
+ */
+static uint8_t updi_relink_step;
+// Breaks left in this attempt, and in the one after it.  One break first; a double break if that doesn't take.
+static uint8_t updi_relink_breaks;
+static uint8_t updi_relink_attempt;
+// Baud rate index to climb back up to
+static uint8_t updi_relink_target;
+// The link was lost at the end of the last op, and is brought back up (at updi_relink_target) before the next.
+static bool updi_op_link_down;
+
+
+static updi_step_t updi_op_goto(updi_op_t *op, uint8_t step) {
+    op->step = step;
+    op->polls = 0;
+    timebase_deadline_end(&updi_op_deadline);
+    return UPDI_STEP_CONTINUE;
+}
+
+static updi_step_t updi_op_fail(updi_op_t *op, updi_err_t err) {
+    op->err = err;
+    return UPDI_STEP_FAILED;
+}
+
+/**
+ * @brief Moves on to step once ticks (10ms) have passed, leaving the kernel free in the meantime.
+ */
+static updi_step_t updi_op_sleep(updi_op_t *op, uint8_t step, uint8_t ticks) {
+    updi_op_goto(op, step);
+    updi_op_sleep_ticks = ticks;
+    return UPDI_STEP_SLEEP;
+}
+
+static bool updi_session_is(uint8_t state) {
+    return (updi_session & (UPDI_SESSION_KNOWN | state)) == (UPDI_SESSION_KNOWN | state);
+}
+
+/**
+ * @brief Records what an ASI_SYS_STATUS read told us.
+ */
+static void updi_session_learn(uint8_t status) {
+    updi_session &= UPDI_SESSION_LINK;
+    updi_session |= UPDI_SESSION_KNOWN;
+    if (!(status & (1 << UPDI_ASI_SYS_STATUS_LOCKSTATUS))) {
+        updi_session |= UPDI_SESSION_UNLOCKED;
+    }
+    if (status & (1 << UPDI_ASI_SYS_STATUS_NVMPROG)) {
+        updi_session |= UPDI_SESSION_NVMPROG;
+    }
+    if (status & (1 << UPDI_ASI_SYS_STATUS_UROWPROG)) {
+        updi_session |= UPDI_SESSION_UROWPROG;
+    }
+}
+
+
+/**
+ * Steps shared by every operation that needs the target in NVM programming mode.  These always come first, and
+ * the operation's own steps are numbered on from PROG_DONE.
+ */
+enum {
+    PROG_CHECK_MODE,
+    PROG_KEY,
+    PROG_RESET,
+    PROG_WAIT_UNLOCK,
+    PROG_DONE
+};
+
+static updi_step_t updi_op_step_prog(updi_op_t *op) {
+    updi_err_t err;
+    uint8_t status;
+
+    switch (op->step) {
+        case PROG_CHECK_MODE:
+            if (updi_session_is(UPDI_SESSION_NVMPROG)) {
+                return updi_op_goto(op, PROG_DONE);
+            }
+            if (updi_session & UPDI_SESSION_KNOWN) {
+                // Known not to be, so no need to ask.
+                return updi_op_goto(op, PROG_KEY);
+            }
+            err = updi_read_sys_status(&status);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            updi_session_learn(status);
+            if (status & (1 << UPDI_ASI_SYS_STATUS_NVMPROG)) {
+                // Already in programming mode, so skip straight to the operation itself
+                return updi_op_goto(op, PROG_DONE);
+            }
+            return updi_op_goto(op, PROG_KEY);
+
+        case PROG_KEY:
+            err = updi_apply_key(UPDI_KEYTYPE_NVM);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            return updi_op_goto(op, PROG_RESET);
+
+        case PROG_RESET:
+            updi_reset_device();
+            return updi_op_goto(op, PROG_WAIT_UNLOCK);
+
+        case PROG_WAIT_UNLOCK:
+            err = updi_read_sys_status(&status);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            if (status & (1 << UPDI_ASI_SYS_STATUS_LOCKSTATUS)) {
+                return UPDI_STEP_POLL;
+            }
+            updi_session_learn(status);
+            return updi_op_goto(op, PROG_DONE);
+    }
+    return updi_op_fail(op, UPDIERR_INVALID_OP);
+}
+
+
+enum {
+    READ_LD = PROG_DONE,
+    READ_STREAM_START,
+    READ_STREAM_WINDOW
+};
+
+static updi_step_t updi_op_step_read(updi_op_t *op) {
+    updi_err_t err;
+
+    if (op->step < PROG_DONE) {
+        if (updi_session_is(UPDI_SESSION_UNLOCKED)) {
+            // An unlocked target can be read as it runs, without the key and reset.
+            return updi_op_goto(op, PROG_DONE);
+        }
+        return updi_op_step_prog(op);
+    }
+
+    switch (op->step) {
+        case READ_LD:
+            if (op->type == UPDI_OP_READ_STREAM) {
+                return updi_op_goto(op, READ_STREAM_START);
+            }
+            err = updi_read_data(op->address, op->data, op->length);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            return UPDI_STEP_DONE;
+
+        case READ_STREAM_START:
+            err = updi_start_stream(op->address + op->offset);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            return updi_op_goto(op, READ_STREAM_WINDOW);
+
+        case READ_STREAM_WINDOW: {
+            // Windows follow on from each other without touching the pointer, one per step.
+            uint32_t left = op->length - op->offset;
+            uint16_t len = left > UPDI_STREAM_WINDOW ? UPDI_STREAM_WINDOW : left;
+            err = updi_read_stream(updi_op_window, len);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            if (!op->sink(op->ctx, op->offset, updi_op_window, len)) {
+                return updi_op_fail(op, UPDIERR_ABORTED);
+            }
+            op->offset += len;
+            if (op->offset >= op->length) {
+                return UPDI_STEP_DONE;
+            }
+            return updi_op_goto(op, READ_STREAM_WINDOW);
+        }
+    }
+    return updi_op_fail(op, UPDIERR_INVALID_OP);
+}
+
+
+enum {
+    PAGE_DIFF_START = PROG_DONE,
+    PAGE_DIFF_WINDOW,
+    PAGE_WAIT_IDLE,
+    PAGE_PREPARE,
+    PAGE_WAIT_PREPARED,
+    PAGE_LOAD,
+    PAGE_WAIT_LOADED,
+    PAGE_COMMIT,
+    PAGE_WAIT_COMMITTED,
+    PAGE_FINISH
+};
+
+/**
+ * @brief Polls the NVM controller until it is idle, then moves on to next.  check_errors once the controller
+ * has been given a command of ours, so a failed write is reported by the op that made it.
+ */
+static updi_step_t updi_op_wait_nvm(updi_op_t *op, uint8_t next, bool check_errors) {
+    bool busy;
+    updi_err_t err = updi_nvm_busy(&busy, check_errors);
+    if (err) {
+        // A link fault goes to the resync ladder like any other step's, rather than being polled through.
+        return updi_op_fail(op, err);
+    }
+    if (busy) {
+        return UPDI_STEP_POLL;
+    }
+    return updi_op_goto(op, next);
+}
+
+/**
+ * @brief Checks the next window of the target page against what the op would leave there, which is op->data
+ * followed by erased (0xFF) bytes up to the end of the page.
+ *
+ * @return true if the window matches.
+ */
+static bool updi_op_window_matches(const updi_op_t *op, uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) {
+        uint16_t pos = op->offset + i;
+        uint8_t expected = pos < op->length ? op->data[pos] : 0xFF;
+        if (updi_op_window[i] != expected) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint16_t updi_op_page_size(const updi_op_t *op) {
+    const updi_device_t *dev = updi_device();
+    if (op->type == UPDI_OP_WRITE_USER_ROW) {
+        // Bound to the whole row, which may be all we know of an unidentified part.
+        return op->length;
+    }
+    return op->type == UPDI_OP_WRITE_EEPROM_PAGE ? dev->eeprom_page_size : dev->flash_page_size;
+}
+
+static updi_step_t updi_op_step_write_page(updi_op_t *op) {
+    updi_err_t err;
+    updi_nvm_mem_t mem = op->type == UPDI_OP_WRITE_EEPROM_PAGE ? UPDI_NVM_EEPROM : UPDI_NVM_FLASH;
+    if (op->type == UPDI_OP_WRITE_USER_ROW) {
+        mem = updi_nvm_user_row_mem();
+    }
+
+    if (op->step < PROG_DONE) {
+        return updi_op_step_prog(op);
+    }
+
+    switch (op->step) {
+        case PAGE_DIFF_START:
+            // A page verify is just the comparison, without the write.
+            if (!(op->flags & UPDI_OP_FLAG_DIFF) && op->type != UPDI_OP_VERIFY_FLASH_PAGE) {
+                return updi_op_goto(op, PAGE_WAIT_IDLE);
+            }
+            // Offset is non-zero when picking up after a link fault.
+            err = updi_start_stream(op->address + op->offset);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            return updi_op_goto(op, PAGE_DIFF_WINDOW);
+
+        case PAGE_DIFF_WINDOW: {
+            // A window per step, same as a streaming read, bailing out to the write at the first difference.
+            uint16_t len = updi_op_page_size(op) - op->offset;
+            if (len > UPDI_STREAM_WINDOW) {
+                len = UPDI_STREAM_WINDOW;
+            }
+            err = updi_read_stream(updi_op_window, len);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            if (!updi_op_window_matches(op, len)) {
+                if (op->type == UPDI_OP_VERIFY_FLASH_PAGE) {
+                    return updi_op_fail(op, UPDIERR_VERIFY_FAILED);
+                }
+                return updi_op_goto(op, PAGE_WAIT_IDLE);
+            }
+            op->offset += len;
+            if (op->offset >= updi_op_page_size(op)) {
+                op->flags |= UPDI_OP_FLAG_UNCHANGED;
+                return UPDI_STEP_DONE;
+            }
+            return updi_op_goto(op, PAGE_DIFF_WINDOW);
+        }
+
+        case PAGE_WAIT_IDLE:
+            // Error bits here could be left over from someone else's write, and prepare clears them.
+            return updi_op_wait_nvm(op, PAGE_PREPARE, false);
+
+        case PAGE_PREPARE:
+            err = updi_nvm_page_prepare(mem, op->address);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            // From here on, offset is how much of the page has been loaded.
+            op->offset = 0;
+            return updi_op_goto(op, PAGE_WAIT_PREPARED);
+
+        case PAGE_WAIT_PREPARED:
+            return updi_op_wait_nvm(op, PAGE_LOAD, true);
+
+        case PAGE_LOAD: {
+            // A controller that can't take the page at once (v2 EEPROM) gets a piece per step, and is waited on
+            // in between.
+            uint16_t unit = updi_nvm_load_unit(mem);
+            uint16_t len = op->length - op->offset;
+            if (unit && len > unit) {
+                len = unit;
+            }
+            err = updi_nvm_page_load(mem, op->address + op->offset, &op->data[op->offset], len);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            op->offset += len;
+            if (!unit) {
+                return updi_op_goto(op, PAGE_COMMIT);
+            }
+            updi_op_goto(op, PAGE_WAIT_LOADED);
+            timebase_deadline_start(&updi_op_deadline, UPDI_OP_LOAD_WAIT_US);
+            return UPDI_STEP_CONTINUE;
+        }
+
+        case PAGE_WAIT_LOADED:
+            return updi_op_wait_nvm(op, op->offset < op->length ? PAGE_LOAD : PAGE_COMMIT, true);
+
+        case PAGE_COMMIT:
+            err = updi_nvm_page_commit(mem);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            return updi_op_goto(op, PAGE_WAIT_COMMITTED);
+
+        case PAGE_WAIT_COMMITTED:
+            // This is where the controller reports the write failing, if it did.
+            return updi_op_wait_nvm(op, PAGE_FINISH, true);
+
+        case PAGE_FINISH:
+            err = updi_nvm_page_finish();
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            return UPDI_STEP_DONE;
+    }
+    return updi_op_fail(op, UPDIERR_INVALID_OP);
+}
+
+
+enum {
+    UROW_KEY,
+    UROW_RESET,
+    UROW_WAIT_PROG,
+    UROW_WRITE,
+    UROW_FINALIZE,
+    UROW_WAIT_DONE,
+    UROW_RELEASE
+};
+
+static updi_step_t updi_op_step_write_user_row(updi_op_t *op) {
+    updi_err_t err;
+    uint8_t status;
+
+    switch (op->step) {
+        case UROW_KEY:
+            err = updi_apply_key(UPDI_KEYTYPE_UROW);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            return updi_op_goto(op, UROW_RESET);
+
+        case UROW_RESET:
+            updi_reset_device();
+            // Out of programming mode, if it was in it
+            updi_session &= ~UPDI_SESSION_KNOWN;
+            return updi_op_goto(op, UROW_WAIT_PROG);
+
+        case UROW_WAIT_PROG:
+            err = updi_read_sys_status(&status);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            if (!(status & (1 << UPDI_ASI_SYS_STATUS_UROWPROG))) {
+                return UPDI_STEP_POLL;
+            }
+            return updi_op_goto(op, UROW_WRITE);
+
+        case UROW_WRITE:
+            // Write to buffer in ram
+            err = updi_write_data(op->address, op->data, op->length);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            return updi_op_goto(op, UROW_FINALIZE);
+
+        case UROW_FINALIZE:
+            updi_user_row_finalize();
+            return updi_op_goto(op, UROW_WAIT_DONE);
+
+        case UROW_WAIT_DONE:
+            err = updi_read_sys_status(&status);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            if (status & (1 << UPDI_ASI_SYS_STATUS_UROWPROG)) {
+                return UPDI_STEP_POLL;
+            }
+            return updi_op_goto(op, UROW_RELEASE);
+
+        case UROW_RELEASE:
+            updi_user_row_release();
+            // Reset with no keys left, so running normally.  Still locked, or we wouldn't have come this way.
+            updi_session = (updi_session & UPDI_SESSION_LINK) | UPDI_SESSION_KNOWN;
+            return UPDI_STEP_DONE;
+    }
+    return updi_op_fail(op, UPDIERR_INVALID_OP);
+}
+
+
+enum {
+    VERIFY_START = PROG_DONE,
+    VERIFY_WAIT
+};
+
+/**
+ * Checks the whole of flash on the target itself, rather than reading it back over the link.  Only tells us
+ * whether flash is good, not where it isn't, so on a failure the caller falls back to UPDI_OP_VERIFY_FLASH_PAGE
+ * on the pages it wrote.
+ */
+static updi_step_t updi_op_step_verify_flash(updi_op_t *op) {
+    updi_err_t err;
+    bool busy;
+
+    if (op->step < PROG_DONE) {
+        return updi_op_step_prog(op);
+    }
+
+    switch (op->step) {
+        case VERIFY_START:
+            err = updi_nvm_scan_start();
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            return updi_op_goto(op, VERIFY_WAIT);
+
+        case VERIFY_WAIT:
+            err = updi_nvm_scan_status(&busy);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            if (busy) {
+                return UPDI_STEP_POLL;
+            }
+            return UPDI_STEP_DONE;
+    }
+    return updi_op_fail(op, UPDIERR_INVALID_OP);
+}
+
+
+enum {
+    RELINK_IDLE,
+    RELINK_BREAK,
+    RELINK_BREAK_RELEASE,
+    RELINK_CLOCK,
+    RELINK_BAUD,
+    RELINK_CHECK
+};
+
+/**
+ * @brief Starts link recovery ahead of the op's next step: breaks breaks, then back up to baud rate index target.
+ * If that doesn't take, a double break is tried, unless breaks was already two.
+ */
+static updi_step_t updi_op_relink(uint8_t target, uint8_t breaks) {
+    updi_relink_step = RELINK_BREAK;
+    updi_relink_target = target;
+    updi_relink_attempt = breaks;
+    updi_relink_breaks = breaks;
+    return UPDI_STEP_CONTINUE;
+}
+
+static updi_step_t updi_op_relink_sleep(uint8_t step, uint8_t ticks) {
+    updi_relink_step = step;
+    updi_op_sleep_ticks = ticks;
+    return UPDI_STEP_SLEEP;
+}
+
+/**
+ * @brief Called when an attempt at recovery hasn't brought the link back.  Goes again with a double break, or
+ * gives up and fails the op.
+ */
+static updi_step_t updi_op_relink_failed(updi_op_t *op) {
+    if (updi_relink_attempt < 2) {
+        return updi_op_relink(updi_relink_target, 2);
+    }
+    DEBUG_PRINT_STRING("UPDI link lost\r\n");
+    updi_relink_step = RELINK_IDLE;
+    updi_resync_finished(false);
+    op->flags |= UPDI_OP_FLAG_LINK_LOST;
+    return updi_op_fail(op, UPDIERR_TIMEOUT);
+}
+
+/**
+ * The break half of a resync (see updi_resync()), and of getting the link back after it was lost or the target's
+ * clock wouldn't go up.  The same steps as the start of a connect, without forgetting what we know.
+ */
+static updi_step_t updi_op_step_relink(updi_op_t *op) {
+    switch (updi_relink_step) {
+        case RELINK_BREAK:
+            updi_break_hold();
+            return updi_op_relink_sleep(RELINK_BREAK_RELEASE, UPDI_OP_BREAK_TICKS);
+
+        case RELINK_BREAK_RELEASE:
+            if (--updi_relink_breaks) {
+                updi_break_release();
+                return updi_op_relink_sleep(RELINK_BREAK, 1);
+            }
+            if (updi_break_done()) {
+                return updi_op_relink_failed(op);
+            }
+            updi_relink_step = updi_relink_target ? RELINK_CLOCK : RELINK_CHECK;
+            return UPDI_STEP_CONTINUE;
+
+        case RELINK_CLOCK:
+            if (updi_raise_clock()) {
+                // The target now needs another break to get back to its default clock, and stays there.
+                updi_relink_target = 0;
+                return updi_op_relink_failed(op);
+            }
+            updi_relink_step = RELINK_BAUD;
+            return UPDI_STEP_CONTINUE;
+
+        case RELINK_BAUD:
+            // One rate per step, as for a connect.  A rate that no longer holds lowers the ceiling and stops here.
+            if (updi_baud_index() < updi_relink_target && updi_step_baud_up()) {
+                return UPDI_STEP_CONTINUE;
+            }
+            updi_relink_step = RELINK_CHECK;
+            return UPDI_STEP_CONTINUE;
+
+        case RELINK_CHECK:
+            if (!updi_check_link()) {
+                return updi_op_relink_failed(op);
+            }
+            updi_relink_step = RELINK_IDLE;
+            updi_op_link_down = false;
+            updi_resync_finished(true);
+            return UPDI_STEP_CONTINUE;
+    }
+    updi_relink_step = RELINK_IDLE;
+    return updi_op_fail(op, UPDIERR_INVALID_OP);
+}
+
+
+enum {
+    CONNECT_BREAK,
+    CONNECT_BREAK_RELEASE,
+    CONNECT_BREAK_AGAIN,
+    CONNECT_CLOCK,
+    CONNECT_BAUD,
+    CONNECT_GUARD,
+    CONNECT_SIB,
+    CONNECT_STATUS,
+    CONNECT_SIGNATURE
+};
+
+static updi_step_t updi_op_step_connect(updi_op_t *op) {
+    updi_err_t err;
+
+    switch (op->step) {
+        case CONNECT_BREAK:
+            // A link we left idle (e.g. after the last session's reset) only needs the one break.  Otherwise,
+            // as at power up or after a fault, the target's UPDI could be in any state, which takes two.
+            op->offset = (updi_session & UPDI_SESSION_LINK) ? 1 : 2;
+
+            // New session, so re-learn what the link is capable of, and what is on the other end of it.
+            updi_session = 0;
+            updi_op_link_down = false;
+            updi_link_defaults();
+            updi_device_forget();
+            updi_break_hold();
+            return updi_op_sleep(op, CONNECT_BREAK_RELEASE, UPDI_OP_BREAK_TICKS);
+
+        case CONNECT_BREAK_RELEASE:
+            if (--op->offset) {
+                updi_break_release();
+                return updi_op_sleep(op, CONNECT_BREAK_AGAIN, 1);
+            }
+            err = updi_break_done();
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            return updi_op_goto(op, CONNECT_CLOCK);
+
+        case CONNECT_BREAK_AGAIN:
+            updi_break_hold();
+            return updi_op_sleep(op, CONNECT_BREAK_RELEASE, UPDI_OP_BREAK_TICKS);
+
+        case CONNECT_CLOCK:
+            if (updi_raise_clock()) {
+                // Not fatal, we just stay at the default clock and baud, once a break has put the target back there.
+                updi_op_goto(op, CONNECT_GUARD);
+                return updi_op_relink(0, 2);
+            }
+            return updi_op_goto(op, CONNECT_BAUD);
+
+        case CONNECT_BAUD:
+            // One rate per step, so the kernel gets a look in between probes.
+            if (updi_step_baud_up()) {
+                return updi_op_goto(op, CONNECT_BAUD);
+            }
+            return updi_op_goto(op, CONNECT_GUARD);
+
+        case CONNECT_GUARD:
+            // Tuned at the final baud rate, as the turnaround we have to beat is a fixed number of bit times.
+            if (updi_step_guard_down()) {
+                return updi_op_goto(op, CONNECT_GUARD);
+            }
+            return updi_op_goto(op, CONNECT_SIB);
+
+        case CONNECT_SIB:
+            err = updi_get_sib((updi_sib_t *) op->data);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            // An unknown controller still leaves the target readable, so that isn't a failed connect.
+            if (updi_nvm_set_version((updi_sib_t *) op->data)) {
+                DEBUG_PRINT_STRING("NVM controller not supported\r\n");
+            }
+            updi_device_set_sib((updi_sib_t *) op->data);
+            updi_session |= UPDI_SESSION_LINK;
+            return updi_op_goto(op, CONNECT_STATUS);
+
+        case CONNECT_STATUS: {
+            // One LDCS now saves every op after it from having to ask.
+            uint8_t status;
+            err = updi_read_sys_status(&status);
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            updi_session_learn(status);
+            if (!(updi_session & UPDI_SESSION_UNLOCKED)) {
+                // A locked part won't give up its signature, so it stays unidentified.  Its user row can still
+                // be found from the family in the SIB.
+                DEBUG_PRINT_STRING("Target locked\r\n");
+                return UPDI_STEP_DONE;
+            }
+            return updi_op_goto(op, CONNECT_SIGNATURE);
+        }
+
+        case CONNECT_SIGNATURE: {
+            // Likewise an unknown part, but anything that needs its memory map will fail with UPDIERR_UNSUPPORTED.
+            uint8_t signature[UPDI_SIGNATURE_SZ];
+            err = updi_read_data(UPDI_SIGROW_ADDR, signature, sizeof(signature));
+            if (err) {
+                return updi_op_fail(op, err);
+            }
+            updi_device_lookup(signature);
+            return UPDI_STEP_DONE;
+        }
+    }
+    return updi_op_fail(op, UPDIERR_INVALID_OP);
+}
+
+
+/**
+ * @brief Fills in or checks the op's address and length against the target's memory map.  Done as the op starts
+ * rather than on submit, as the target may not have been identified when it was queued.
+ */
+static updi_err_t updi_op_bind(updi_op_t *op) {
+    const updi_device_t *dev = updi_device();
+    uint32_t base, size, page;
+
+    switch (op->type) {
+        case UPDI_OP_READ_USER_ROW:
+        case UPDI_OP_WRITE_USER_ROW: {
+            uint16_t addr, len;
+            if (!updi_device_user_row(&addr, &len)) {
+                return UPDIERR_UNSUPPORTED;
+            }
+            op->address = addr;
+            op->length = len;
+            if (op->type == UPDI_OP_READ_USER_ROW && (updi_session & UPDI_SESSION_KNOWN) &&
+                    !(updi_session & UPDI_SESSION_UNLOCKED)) {
+                // A locked part's row can be written, with the UROWWRITE key, but not read back.
+                return UPDIERR_UNSUPPORTED;
+            }
+            if (op->type == UPDI_OP_WRITE_USER_ROW && updi_session_is(UPDI_SESSION_UNLOCKED)) {
+                // The UROWWRITE key is for locked parts.  Unlocked, the row is just another NVM page, which
+                // saves two resets and shares programming mode with whatever else is going on.
+                op->flags |= UPDI_OP_FLAG_VIA_NVM;
+            }
+            return UPDI_OK;
+        }
+
+        case UPDI_OP_WRITE_FLASH_PAGE:
+        case UPDI_OP_WRITE_EEPROM_PAGE:
+        case UPDI_OP_VERIFY_FLASH_PAGE:
+            if (!dev) {
+                return UPDIERR_UNSUPPORTED;
+            }
+            if (op->type != UPDI_OP_WRITE_EEPROM_PAGE) {
+                base = dev->flash_base;
+                size = dev->flash_size;
+                page = dev->flash_page_size;
+            } else {
+                base = dev->eeprom_base;
+                size = dev->eeprom_size;
+                page = dev->eeprom_page_size;
+            }
+            if (op->address < base || op->address + op->length > base + size ||
+                    (op->address - base) % page != 0 || op->length > page) {
+                return UPDIERR_INVALID_SIZE;
+            }
+            return UPDI_OK;
+
+        default:
+            return UPDI_OK;
+    }
+}
+
+static updi_step_t updi_op_step(updi_op_t *op) {
+    if (updi_relink_step != RELINK_IDLE) {
+        return updi_op_step_relink(op);
+    }
+    if (op->step == 0 && updi_op_link_down && op->type != UPDI_OP_CONNECT) {
+        // Left down by the last op.  Straight to a double break, as we've no idea what state it's in.
+        return updi_op_relink(updi_relink_target, 2);
+    }
+    if (op->step == 0) {
+        updi_err_t err = updi_op_bind(op);
+        if (err) {
+            return updi_op_fail(op, err);
+        }
+    }
+
+    switch (op->type) {
+        case UPDI_OP_CONNECT:
+            return updi_op_step_connect(op);
+        case UPDI_OP_READ:
+        case UPDI_OP_READ_STREAM:
+        case UPDI_OP_READ_USER_ROW:
+            return updi_op_step_read(op);
+        case UPDI_OP_WRITE_USER_ROW:
+            if (op->flags & UPDI_OP_FLAG_VIA_NVM) {
+                return updi_op_step_write_page(op);
+            }
+            return updi_op_step_write_user_row(op);
+        case UPDI_OP_WRITE_FLASH_PAGE:
+        case UPDI_OP_WRITE_EEPROM_PAGE:
+        case UPDI_OP_VERIFY_FLASH_PAGE:
+            return updi_op_step_write_page(op);
+        case UPDI_OP_VERIFY_FLASH:
+            return updi_op_step_verify_flash(op);
+        case UPDI_OP_RESET:
+            updi_reset_device();
+            // Running normally, keys cleared.
+            updi_session &= ~(UPDI_SESSION_NVMPROG | UPDI_SESSION_UROWPROG);
+            return UPDI_STEP_DONE;
+    }
+    return updi_op_fail(op, UPDIERR_INVALID_OP);
+}
+
+
+/**
+ * @brief Recovers from a step failing with a link fault, by resyncing the link and setting the op up to retry.
+ * The target isn't touched by a resync, so most steps are simply run again.  Streams have to be restarted, as
+ * the target's pointer is somewhere in the window that failed.  So does a page from its load onwards: the fault
+ * may have hidden a commit that went through, and a v0 controller clears its page buffer once it has committed,
+ * so running the commit again would erase-write the page from an empty buffer.
+ *
+ * If the cheap resync doesn't bring the link back, the op goes through the relink steps before the retry.  If the
+ * resyncs run out, the op is flagged UPDI_OP_FLAG_LINK_LOST, for updi_op_complete() to drop the baud rate.
+ *
+ * @return true if the op can carry on.
+ */
+static bool updi_op_retry(updi_op_t *op) {
+    if (op->flags & UPDI_OP_FLAG_LINK_LOST) {
+        // The relink steps have already given up.
+        return false;
+    }
+    if (op->type == UPDI_OP_CONNECT && op->step < CONNECT_SIB) {
+        // Still setting the link up, so there's nothing to get back to.
+        return false;
+    }
+    if (op->err != UPDIERR_TIMEOUT && op->err != UPDIERR_NACK && op->err != UPDIERR_OVERRUN) {
+        return false;
+    }
+    if (op->retries >= UPDI_OP_MAX_RETRIES) {
+        op->flags |= UPDI_OP_FLAG_LINK_LOST;
+        return false;
+    }
+    if (updi_resync(op->err)) {
+        updi_op_relink(updi_baud_index(), 1);
+    }
+
+    DEBUG_PRINT_STRING("UPDI link recovering, retrying step ");
+    DEBUG_PRINT_INT(op->step);
+    DEBUG_PRINT_STRING("\r\n");
+
+    op->retries++;
+    op->err = UPDI_OK;
+    // Step numbers overlap between op types, so the type has to be checked as well.
+    bool page_op = op->type == UPDI_OP_WRITE_FLASH_PAGE || op->type == UPDI_OP_WRITE_EEPROM_PAGE ||
+        op->type == UPDI_OP_VERIFY_FLASH_PAGE || (op->flags & UPDI_OP_FLAG_VIA_NVM);
+    if (op->type == UPDI_OP_READ_STREAM && op->step == READ_STREAM_WINDOW) {
+        updi_op_goto(op, READ_STREAM_START);
+    } else if (page_op && op->step == PAGE_DIFF_WINDOW) {
+        updi_op_goto(op, PAGE_DIFF_START);
+    } else if (page_op && (op->step == PAGE_LOAD || op->step == PAGE_COMMIT)) {
+        updi_op_goto(op, PAGE_WAIT_IDLE);
+    } else {
+        updi_op_goto(op, op->step);
+    }
+    return true;
+}
+
+
+static void updi_op_schedule() {
+    if (!updi_op_scheduled) {
+        updi_op_scheduled = true;
+        ke_msg_send_basic(updi_op_msg, TASK_APP, TASK_APP);
+    }
+}
+
+static void updi_op_timer_cb() {
+    updi_op_timer = EASY_TIMER_INVALID_TIMER;
+    updi_op_schedule();
+}
+
+/**
+ * @brief Runs the engine again once ticks (10ms) have passed.  If there's no timer to be had, the wait is kept
+ * owing and the engine comes back round on a message to try again, rather than stalling with the op queued.
+ */
+static void updi_op_defer(uint8_t ticks) {
+    updi_op_timer = app_easy_timer(ticks, updi_op_timer_cb);
+    if (updi_op_timer == EASY_TIMER_INVALID_TIMER) {
+        updi_op_deferred = ticks;
+        updi_op_schedule();
+    }
+}
+
+/**
+ * @brief Holds off extended sleep while there are ops to run, and lets it back in once the queue has drained.
+ */
+static void updi_op_keep_awake(bool awake) {
+    if (awake == updi_op_awake) {
+        return;
+    }
+    updi_op_awake = awake;
+    if (awake) {
+        arch_force_active_mode();
+    } else {
+        arch_restore_sleep_mode();
+    }
+}
+
+static void updi_op_complete(updi_err_t err) {
+    // Take a copy and pop it first, so the callback is free to queue up the next operation.
+    updi_op_t op = updi_op_queue[updi_op_head];
+    updi_op_head = (updi_op_head + 1) % UPDI_OP_QUEUE_SZ;
+    updi_op_count--;
+    timebase_deadline_end(&updi_op_deadline);
+    updi_relink_step = RELINK_IDLE;
+
+    if (err) {
+        // We can't be sure where a failed op left the target.  Ask again next time.
+        updi_session &= ~UPDI_SESSION_KNOWN;
+    }
+
+    if (op.flags & UPDI_OP_FLAG_LINK_LOST) {
+        // The link isn't coping with the rate we negotiated.  Drop down a notch, and get it back up there (which
+        // takes a break) before the next op.
+        updi_session &= ~UPDI_SESSION_LINK;
+        updi_relink_target = updi_baud_fallback();
+        updi_op_link_down = true;
+    }
+
+    if (err) {
+        DEBUG_PRINT_STRING("UPDI op failed ");
+        DEBUG_PRINT_INT(op.type);
+        DEBUG_PRINT_STRING(" step ");
+        DEBUG_PRINT_INT(op.step);
+        DEBUG_PRINT_STRING(" err ");
+        DEBUG_PRINT_INT(err);
+        DEBUG_PRINT_STRING("\r\n");
+    }
+
+    updi_cache_op_complete(&op, err);
+    if (op.cb) {
+        op.cb(&op, err);
+    }
+    if (updi_op_count) {
+        updi_op_schedule();
+    } else {
+        updi_op_keep_awake(false);
+    }
+}
+
+/**
+ * @brief Runs one step of the operation at the head of the queue.  Called from the kernel via updi_op_msg.
+ */
+static void updi_op_run() {
+    updi_op_scheduled = false;
+    if (!updi_op_count || updi_op_timer != EASY_TIMER_INVALID_TIMER) {
+        return;
+    }
+    if (updi_op_deferred) {
+        uint8_t ticks = updi_op_deferred;
+        updi_op_deferred = 0;
+        updi_op_defer(ticks);
+        return;
+    }
+
+    updi_op_t *op = &updi_op_queue[updi_op_head];
+    switch (updi_op_step(op)) {
+        case UPDI_STEP_CONTINUE:
+            updi_op_schedule();
+            break;
+
+        case UPDI_STEP_POLL:
+            if (updi_op_deadline.armed) {
+                // The step has its own time limit, so keep polling flat out until then.
+                if (timebase_expired(&updi_op_deadline)) {
+                    updi_op_complete(UPDIERR_BUSY);
+                } else {
+                    updi_op_schedule();
+                }
+            } else if (++op->polls >= UPDI_OP_MAX_POLLS) {
+                updi_op_complete(UPDIERR_BUSY);
+            } else if (op->polls >= UPDI_OP_FAST_POLLS) {
+                updi_op_defer(1);
+            } else {
+                updi_op_schedule();
+            }
+            break;
+
+        case UPDI_STEP_SLEEP:
+            updi_op_defer(updi_op_sleep_ticks);
+            break;
+
+        case UPDI_STEP_DONE:
+            updi_op_complete(UPDI_OK);
+            break;
+
+        case UPDI_STEP_FAILED:
+            if (updi_op_retry(op)) {
+                updi_op_schedule();
+            } else {
+                updi_op_complete(op->err);
+            }
+            break;
+    }
+}
+
+
+void updi_op_init() {
+    updi_op_head = 0;
+    updi_op_count = 0;
+    updi_op_scheduled = false;
+    updi_op_deferred = 0;
+    updi_relink_step = RELINK_IDLE;
+    updi_op_link_down = false;
+    updi_op_msg = app_easy_msg_set(updi_op_run);
+}
+
+/**
+ * @brief Queues an operation.  The op is copied, so it need not outlive the call (its data buffer does).
+ *
+ * @return true if queued, false if the queue is full.
+ */
+bool updi_op_submit(const updi_op_t *op) {
+    if (updi_op_count >= UPDI_OP_QUEUE_SZ) {
+        return false;
+    }
+    if (op->type == UPDI_OP_READ_STREAM && (!op->sink || !op->length)) {
+        return false;
+    }
+    if (op->type != UPDI_OP_READ_STREAM && op->length > UINT16_MAX) {
+        // Everything else goes to or from a buffer in one transfer.
+        return false;
+    }
+    if ((op->type == UPDI_OP_WRITE_FLASH_PAGE || op->type == UPDI_OP_WRITE_EEPROM_PAGE ||
+            op->type == UPDI_OP_VERIFY_FLASH_PAGE) && (!op->data || !op->length)) {
+        return false;
+    }
+    updi_op_t *slot = &updi_op_queue[(updi_op_head + updi_op_count) % UPDI_OP_QUEUE_SZ];
+    *slot = *op;
+    slot->step = 0;
+    slot->polls = 0;
+    slot->offset = 0;
+    slot->err = UPDI_OK;
+    slot->retries = 0;
+    slot->flags &= ~(UPDI_OP_FLAG_UNCHANGED | UPDI_OP_FLAG_VIA_NVM | UPDI_OP_FLAG_LINK_LOST);
+    updi_op_count++;
+    updi_op_keep_awake(true);
+    updi_op_schedule();
+    return true;
+}
+
+bool updi_op_busy() {
+    return updi_op_count != 0;
+}
@@ -16,25 +16,14 @@
 #include <spi_flash.h>
 
 #include "updi.h"
+#include "updi_op.h"
+#include "timebase.h"
 #include <uart.h>
 
 
 void usDelay(uint32_t nof_us)
 {
-    while ( nof_us-- )
-    {
-        __NOP();
-        __NOP();
-        __NOP();
-        __NOP();
-        __NOP();
-        __NOP();
-        __NOP();
-        __NOP();
-        __NOP();
-        __NOP();
-        __NOP();
-    }
+    timebase_delay_us(nof_us);
 }
 
 
@@ -61,6 +50,8 @@ void app_on_init(void)
     // To keep compatibility call default handler
     default_app_on_init();
 
+    updi_op_init();
+
     extern uint32_t __StackTop;
     extern uint32_t __HeapBase;
     extern uint32_t __HeapLimit;
@@ -39,6 +39,8 @@
 #include <uart.h>
 
 #include <debug.h>
+#include "updi.h"
+#include "timebase.h"
 
 // Dev Kit flash is 1 Mbit, or 256K.
 #define SPI_FLASH_DEV_SIZE          (256 * 1024)
@@ -177,6 +179,12 @@ void periph_init(void)
     // UPDI baud is autodetected (Max 225 Kbit when at default 4Mhz clock), with 2 stop bits and even parity
     uart_one_wire_enable(UART2, UPDI_PORT, UPDI_PIN);
 
+    // Timeouts and delays run off Timer0, leaving SysTick free.
+    timebase_init();
+
+    // Received bytes are buffered from the RX interrupt rather than polled.
+    updi_init();
+
     // Break and idle are special
     // Break (held low) minimum duration = 24.6Ms
     // Idle 